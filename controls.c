@@ -28,7 +28,7 @@ static char *xml(unsigned char *s)
     return buf;
 }
 
-int set_control( int fd, char *buf, int size, int cid, int val)
+int set_control( int fd, FILE *out, int cid, int val)
 {
     struct v4l2_control con = {
 	.id = cid,
@@ -36,25 +36,23 @@ int set_control( int fd, char *buf, int size, int cid, int val)
     
     if ( xioctl( fd, VIDIOC_G_CTRL, &con)) {
         log_f("set_control failed to check value: %s\n", strerror(errno));
-	//return snprintf( buf, size, "failed to get check value: %s\n", strerror(errno));
+	//return fprintf( out, "failed to get check value: %s\n", strerror(errno));
     }
 
     con.value = val;
     if ( xioctl( fd, VIDIOC_S_CTRL, &con)) {
         log_f("set_control failed to set value: %s\n", strerror(errno));
-	return snprintf( buf, size, "failed to set value: %s\n", strerror(errno));
+	return fprintf( out, "failed to set value: %s\n", strerror(errno));
     }
-    return snprintf(buf, size, "OK");
+    return fprintf( out, "OK");
 }
 
-int list_controls( int fd, char *buf, int size, int cidArg, int valArg)
+int list_controls( int fd, FILE *out, int cidArg, int valArg)
 {
     int cid, mindex;
-    int used = 0;
 
-    //log_f("buf=%08p, size=%d\n", buf, size);
-    used += snprintf( buf+used, size-used, "<?xml version=\"1.0\" ?>\n");
-    used += snprintf( buf+used, size-used, "<controls>\n");
+    fprintf( out, "<?xml version=\"1.0\" ?>\n");
+    fprintf( out, "<controls>\n");
 
     cid = 0;
     for (;;) {
@@ -88,7 +86,7 @@ int list_controls( int fd, char *buf, int size, int cidArg, int valArg)
 	    
 	    switch( queryctrl.type) {
 	    case V4L2_CTRL_TYPE_MENU:
-	      used += snprintf( buf+used, size-used, 
+	      fprintf( out,
 				"<menu_control name=%s minimum=\"%d\" maximum=\"%d\" default=\"%d\" current=\"%d\" cid=\"%d\">\n", 
 				xml(queryctrl.name),
 				queryctrl.minimum, queryctrl.maximum, queryctrl.default_value, con.value, con.id);
@@ -101,18 +99,18 @@ int list_controls( int fd, char *buf, int size, int cidArg, int valArg)
 		  if ( xioctl( fd, VIDIOC_QUERYMENU, &menu)) {
 		      log_f("Failed to query control %s menu index %d: %s\n", queryctrl.name, mindex, strerror(errno));
 		  }
-		  used += snprintf( buf+used, size-used, "  <menu_item index=\"%d\" name=%s />\n", mindex, xml(menu.name));
+		  fprintf( out, "  <menu_item index=\"%d\" name=%s />\n", mindex, xml(menu.name));
 	      }
-	      used += snprintf( buf+used, size-used, "</menu_control>\n");
+	      fprintf( out, "</menu_control>\n");
 	      break;
 	    case V4L2_CTRL_TYPE_BOOLEAN:
-	      used += snprintf( buf+used, size-used, 
+	      fprintf( out,
 				"<boolean_control name=%s default=\"%d\" current=\"%d\" cid=\"%d\" />\n",
 				xml(queryctrl.name),
 				queryctrl.default_value, con.value, con.id);
 	      break;
 	    case V4L2_CTRL_TYPE_INTEGER:
-	      used += snprintf( buf+used, size-used, "<range_control name=%s minimum=\"%d\" maximum=\"%d\" by=\"%d\" default=\"%d\" current=\"%d\" cid=\"%d\""
+	      fprintf( out, "<range_control name=%s minimum=\"%d\" maximum=\"%d\" by=\"%d\" default=\"%d\" current=\"%d\" cid=\"%d\""
 				"%s%s%s%s%s%s />\n",
 				xml(queryctrl.name), 
 				queryctrl.minimum, queryctrl.maximum, queryctrl.step, queryctrl.default_value, con.value, con.id,
@@ -135,9 +133,7 @@ int list_controls( int fd, char *buf, int size, int cidArg, int valArg)
     }
 
 
-    used += snprintf( buf+used, size-used, "</controls>\n");
-    //log_f("%d %s\n", used, buf);
-    return used;
+    return fprintf( out, "</controls>\n");
 }
 
 void add_logitech_controls(int fd)
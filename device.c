@@ -81,7 +81,7 @@ static int read_frame(void)
 	      
 	      assert (buf.index < n_buffers);
 	      new_frame (buffers[buf.index].start, buf.bytesused, &buf);
-	      if ( buf.type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+	      while ( reclaim_buffer( &buf)) {
 		  if (-1 == xioctl (videodev, VIDIOC_QBUF, &buf)) errno_exit ("VIDIOC_QBUF");
 	      }
 	  }
@@ -113,7 +113,7 @@ static int read_frame(void)
 	      
 	      assert (i < n_buffers);
 	      new_frame ((void *) buf.m.userptr, buf.bytesused, &buf);
-	      if ( buf.type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+	      while ( reclaim_buffer( &buf)) {
 		  if (-1 == xioctl (videodev, VIDIOC_QBUF, &buf)) errno_exit ("VIDIOC_QBUF");
 	      }
 	  }
@@ -269,6 +269,7 @@ void init_mmap (void)
 	
 	if (MAP_FAILED == buffers[n_buffers].start) errno_exit ("mmap");
     }
+    set_frame_buffers( n_buffers);
 }
 
 void init_userp	(unsigned int buffer_size)
@@ -301,6 +302,7 @@ void init_userp	(unsigned int buffer_size)
 	  fatal_f( "Out of memory\n");
 	}
     }
+    set_frame_buffers( n_buffers);
 }
 
 
@@ -528,12 +530,12 @@ void open_device ( void)
 }
 
 
-int with_device( video_action func, char *buf, int size, int cid, int val)
+int with_device( video_action func, FILE *out, int cid, int val)
 {
     int r;
 
     pthread_mutex_lock(&video_mutex);
-    r = (*func)(videodev, buf, size, cid, val);
+    r = (*func)(videodev, out, cid, val);
     pthread_mutex_unlock(&video_mutex);
     return r;
 }
@@ -1,5 +1,5 @@
 /*
-** we need this for the read/write pthread locks
+** we need this for clock_gettime()
 */
 #define _XOPEN_SOURCE 600
 
@@ -10,31 +10,76 @@
 #include <string.h>
 
 #include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
 #include <linux/videodev2.h>
 
 #include "tinycamd.h"
 
+#define FRAME_SLOTS 8          // frames alive at once, the current one and those still being read
+#define FRAME_HOLD_MS 250      // a camera buffer read for longer than this makes us copy the next frames
+#define FRAME_MIN_QUEUED 2     // camera buffers we always leave with the driver
+
+/*
+** A frame is a slot in a small ring. The current frame holds a reference to
+** its slot, and so does each reader while it looks at it, so a newer frame
+** never has to wait for the readers of an older one. The data is either
+** still in the camera's buffer, which goes back to the driver once the last
+** reference has gone, or our own copy, when the driver couldn't spare the
+** buffer or we read() it.
+**
+** There are no locks. Only the capture thread writes frames, and it only
+** reuses a slot it has claimed by moving refs from 0 to 1. A reader bumps
+** refs on whatever 'current' points to and then looks again. If that is
+** still current, the slot can't be claimed from under it. If not, it was
+** replaced, or even reused, in the meantime, so the reader lets go without
+** having touched it and tries again. 'held', 'buffer' and 'replaced' are
+** only ever used by the capture thread.
+*/
 struct frame {
-    pthread_rwlock_t lock; // following 4 fields guarded by lock
+    int refs;
     void *data;
     unsigned int length;
     unsigned int hufftabInsert;
-    struct v4l2_buffer buffer;
+    struct jpeg_index jpeg;
+    struct frame_info info;
 
-    pthread_cond_t cond;
-    pthread_mutex_t mutex;
-    int serial;            // this is guarded by mutex, not lock.
+    int held;                  // data is in the camera buffer 'buffer'
+    struct v4l2_buffer buffer;
+    uint64_t replaced;         // ms, when a newer frame became current
 
+    void *copy;                // our buffer for when we copy, kept for the next time
+    unsigned int copySize;
 };
 
-static struct frame currentFrame = {
-    .lock = PTHREAD_RWLOCK_INITIALIZER,
+static struct frame frames[FRAME_SLOTS];
+static struct frame *current = 0;       // only by __atomic_load_n() and __atomic_store_n()
+static unsigned int cameraBuffers = 0;   // the driver's, 0 if we read() frames
+static unsigned int heldBuffers = 0;     // of those, how many frames have, or have finished with
+static struct v4l2_buffer bounced;       // the capture thread's, copied and ready to go straight back
+static int bouncePending = 0;
+static unsigned long rejectedFrames = 0;
+
+static void (*frameListener)(void) = 0;
 
-    // this cond and associated mutex is used to wait for the next frame
+// this cond and associated mutex is used to wait for the next frame
+static struct {
+    pthread_cond_t cond;
+    pthread_mutex_t mutex;
+    int serial;
+} currentFrame = {
     .cond = PTHREAD_COND_INITIALIZER,
     .mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /*
 ** MPJEG files are typically, though not always, missing their DHT. If they are
 ** missing then this is almost certainly what they need. I'd feel a lot better
@@ -78,51 +123,157 @@ static const unsigned char fixed_dht[] = {
   0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
 };
 
-static unsigned int find_hufftab_location(const unsigned char *p, unsigned int len)
+/*
+** Tell us how many buffers the camera driver has, so we never hold so many of
+** them that it runs dry. Without this every frame is copied.
+*/
+void set_frame_buffers( unsigned int count)
+{
+    cameraBuffers = count;
+}
+
+/*
+** Pick the zero copy or the copy for a new frame in a camera buffer. We only
+** hold on to it if the driver keeps enough to carry on with, and no reader
+** has kept an older one past FRAME_HOLD_MS, which says the readers are slow
+** and the buffers had better go straight back. A reader passing through a
+** slot can make one look busy for a moment, which only costs a copy.
+*/
+static int must_copy( uint64_t t, const struct frame *cur)
+{
+    int i;
+
+    if ( heldBuffers + 1 + FRAME_MIN_QUEUED > cameraBuffers) return 1;
+    for ( i = 0; i < FRAME_SLOTS; i++) {
+	struct frame *f = &frames[i];
+
+	if ( f->held && f != cur && __atomic_load_n( &f->refs, __ATOMIC_SEQ_CST) && t - f->replaced > FRAME_HOLD_MS) return 1;
+    }
+    return 0;
+}
+
+/*
+** Take a slot for a new frame, 0 if every one is in use. Only the capture
+** thread claims slots, but a reader may be bumping refs on any of them.
+*/
+static struct frame *claim_slot( const struct frame *cur)
 {
-    unsigned int i;
+    int i;
 
-    for ( i = 0; i < len-1; i++) {
-	// Has its own DHT table
-	if ( p[i] == 0xff && p[i+1]== 0xc4) return 0;
+    for ( i = 0; i < FRAME_SLOTS; i++) {
+	struct frame *f = &frames[i];
 
-	// Needs a DHT here
-	if ( p[i] == 0xff && p[i+1] == 0xda) return i;
+	if ( f == cur || f->held) continue;
+	if ( __sync_bool_compare_and_swap( &f->refs, 0, 1)) return f;   // the reference the current frame will hold
     }
-    return 0;  /* reall oughtn't get here */
+    return 0;
 }
 
+/*
+** The pieces of a frame as it goes to clients, with the DHT it needed spliced in.
+*/
+static void frame_chunks( const struct frame *f, struct chunk c[4])
+{
+    if ( f->hufftabInsert == 0) {
+	c[0].data = f->data;
+	c[0].length = f->length;
+	c[1].data = 0;
+    } else {
+	c[0].data = f->data;
+	c[0].length = f->hufftabInsert;
+	c[1].data = fixed_dht;
+	c[1].length = sizeof(fixed_dht);
+	c[2].data = (char *)f->data + f->hufftabInsert;
+	c[2].length = f->length - f->hufftabInsert;
+	c[3].data = 0;
+    }
+}
 
 /*
-** Buf is the new buffer on the way in, but is set to the old buffer on the way out.
-** If there is no old buffer then the .type field will be zero.
+** Publish a new frame. If buf is given the data is in that camera buffer,
+** which is ours until reclaim_buffer() hands it back, otherwise the data is
+** only good until we return and is copied. Never waits for a reader.
+** A JPEG which isn't whole, usually one cut short on its way from the
+** camera, is thrown away and the last good frame stays current.
 */
 void new_frame( void *data, unsigned int length, struct v4l2_buffer *buf)
 {
-    struct v4l2_buffer obuf;
+    static struct jpeg_index index;    // only the capture thread is in here
+    int jpeg = (camera_method != CAMERA_METHOD_YUYV);
+    uint64_t t = now_ms();
+    struct frame *old, *f;
+    int copy;
     int rc;
 
-    if ( pthread_rwlock_wrlock( &currentFrame.lock)) {
-      fatal_f("Failed to acquire current frame write lock: %s\n", strerror(errno));
+    if ( jpeg && !jpeg_index_frame( data, length, &index)) {
+	__sync_fetch_and_add( &rejectedFrames, 1);
+	log_f("Frame of %u bytes isn't a whole JPEG, dropping it\n", length);
+	if ( buf) {
+	    bounced = *buf;
+	    bouncePending = 1;
+	}
+	return;
+    }
+
+    old = __atomic_load_n( &current, __ATOMIC_SEQ_CST);
+    f = claim_slot( old);
+    copy = !buf || must_copy( t, old);
+
+    if ( f && copy && f->copySize < length) {
+	free( f->copy);
+	f->copySize = length + length/4;   // room for the next frame to be a bit bigger
+	f->copy = malloc( f->copySize);
+	if ( !f->copy) {
+	    f->copySize = 0;
+	    __sync_fetch_and_sub( &f->refs, 1);
+	    f = 0;
+	}
     }
-    // log_f("write locked frame\n");
-
-    obuf = currentFrame.buffer;
-    currentFrame.data = data;
-    currentFrame.length = length;
-    currentFrame.hufftabInsert = (camera_method == CAMERA_METHOD_MJPEG) ? find_hufftab_location( currentFrame.data, currentFrame.length) : 0;
-
-    if ( buf) {
-	currentFrame.buffer = *buf;
-    } else currentFrame.buffer.type = 0;
-    
-    if ( buf) *buf = obuf;
-    // log_f("new_frame %08x %d\n", (unsigned int)data, length);
-
-    if ( pthread_rwlock_unlock( &currentFrame.lock)) {
-      fatal_f("Failed to release current frame write lock: %s\n", strerror(errno));
+    if ( !f) {
+	log_f("No frame slot free, dropping a frame\n");
+	if ( buf) {
+	    bounced = *buf;
+	    bouncePending = 1;
+	}
+	return;
     }
-    // log_f("write unlocked frame\n");
+
+    if ( copy) {
+	memcpy( f->copy, data, length);
+	f->data = f->copy;
+	f->held = 0;
+	if ( buf) {
+	    bounced = *buf;
+	    bouncePending = 1;
+	}
+    } else {
+	f->data = data;
+	f->held = 1;
+	f->buffer = *buf;
+    }
+    f->length = length;
+    if ( jpeg) {
+	f->jpeg = index;
+	f->info.jpeg = &f->jpeg;
+    } else {
+	f->info.jpeg = 0;
+    }
+    // an MJPEG without its own DHT before the scan needs the standard one there
+    f->hufftabInsert = 0;
+    if ( camera_method == CAMERA_METHOD_MJPEG && (index.dht == 0 || index.dht > index.sos)) f->hufftabInsert = index.sos;
+
+    // serial is only ever changed by us, so we can peek without the mutex
+    f->info.serial = currentFrame.serial + 1;
+    if ( buf && (buf->timestamp.tv_sec || buf->timestamp.tv_usec)) {
+	f->info.timestamp = buf->timestamp;
+    } else {
+	gettimeofday( &f->info.timestamp, 0);
+    }
+
+    if ( f->held) heldBuffers++;
+    if ( old) old->replaced = t;
+    __atomic_store_n( &current, f, __ATOMIC_SEQ_CST);
+    if ( old) __sync_fetch_and_sub( &old->refs, 1);
 
     // Notify folk that the frame has changed
     rc = pthread_mutex_lock(&currentFrame.mutex);
@@ -130,74 +281,130 @@ void new_frame( void *data, unsigned int length, struct v4l2_buffer *buf)
     rc = pthread_cond_broadcast(&currentFrame.cond);
     rc = pthread_mutex_unlock(&currentFrame.mutex);
 
+    if ( frameListener) (*frameListener)();
+
+    if ( history_seconds) {   // f is current, so it is ours to look at until the next frame
+	struct chunk c[4];
+
+	frame_chunks( f, c);
+	history_add( c, &f->info);
+    }
     return;
 }
 
-static void with_current_frame_cleanup( void *arg) 
+/*
+** Give the capture thread a camera buffer which no frame needs any more, to
+** queue again. Returns 0 when there are none. Call it after each new_frame().
+*/
+int reclaim_buffer( struct v4l2_buffer *buf)
 {
-    if ( pthread_rwlock_unlock( &currentFrame.lock)) {
-	fatal_f("Failed to release current frame read lock: %s\n", strerror(errno));
+    struct frame *cur = __atomic_load_n( &current, __ATOMIC_SEQ_CST);
+    int i;
+
+    if ( bouncePending) {
+	*buf = bounced;
+	bouncePending = 0;
+	return 1;
+    }
+
+    for ( i = 0; i < FRAME_SLOTS; i++) {
+	struct frame *f = &frames[i];
+
+	// a reader which bumps refs after this finds f isn't current and never looks at it
+	if ( f->held && f != cur && __atomic_load_n( &f->refs, __ATOMIC_SEQ_CST) == 0) {
+	    *buf = f->buffer;
+	    f->held = 0;
+	    heldBuffers--;
+	    return 1;
+	}
     }
+    return 0;
 }
 
-void with_current_frame( frame_sender func, void *arg)
+/*
+** Have func called from the capture thread after each new frame is published.
+** It must be quick, the camera is waiting.
+*/
+void set_frame_listener( void (*func)(void))
 {
-    struct chunk c[4];
-    int oldState;
-
-    //
-    // Well, Ick! It is undefined to unlock a rwlock that you didn't lock. That
-    // makes deciding if an unlock is needed in the face of a pthread_cancel() very
-    // ugly indeed.
-    //
-    pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &oldState);
-    pthread_cleanup_push( with_current_frame_cleanup, 0);
-    if ( pthread_rwlock_rdlock( &currentFrame.lock)) {
-      fatal_f("Failed to acquire current frame read lock: %s\n", strerror(errno));
+    frameListener = func;
+}
+
+unsigned long rejected_frames(void)
+{
+    return __atomic_load_n( &rejectedFrames, __ATOMIC_RELAXED);
+}
+
+/*
+** Get a reference to the current frame without taking any lock, see the
+** comment on struct frame. 0 if the camera hasn't given us one yet.
+*/
+static struct frame *hold_current(void)
+{
+    struct frame *f;
+
+    for (;;) {
+	f = __atomic_load_n( &current, __ATOMIC_SEQ_CST);
+	if ( !f) return 0;
+	__sync_fetch_and_add( &f->refs, 1);
+	if ( __atomic_load_n( &current, __ATOMIC_SEQ_CST) == f) return f;
+	__sync_fetch_and_sub( &f->refs, 1);
     }
-    pthread_setcancelstate( oldState,0);
-    log_f("read locked frame\n");
+}
 
-    if ( currentFrame.hufftabInsert == 0) {
-	c[0].data = currentFrame.data;
-	c[0].length = currentFrame.length;
-	c[1].data = 0;
-    } else {
-	c[0].data = currentFrame.data;
-	c[0].length = currentFrame.hufftabInsert;
-	c[1].data = fixed_dht;
-	c[1].length = sizeof(fixed_dht);
-	c[2].data = currentFrame.data + currentFrame.hufftabInsert;
-	c[2].length = currentFrame.length - currentFrame.hufftabInsert;
-	c[3].data = 0;
+/*
+** Take a reference to the current frame, for as long as the caller likes,
+** and fill in its chunks and info. Give it back with release_frame(). If the
+** camera hasn't given us a frame yet c is empty and 0 is returned.
+*/
+struct frame *hold_frame( struct chunk c[4], struct frame_info *info)
+{
+    static const struct frame_info none;
+    struct frame *f = hold_current();
+
+    if ( !f) {   // nothing from the camera yet
+	c[0].data = 0;
+	*info = none;
+	return 0;
     }
-    (*func)(c,arg);
+    log_f("holding frame %u\n", f->info.serial);
 
-    pthread_cleanup_pop( 1);
-    log_f("read unlocked frame\n");
+    frame_chunks( f, c);
+    *info = f->info;
+    return f;
 }
 
-static void with_next_frame_cleanup( void *arg)
+void release_frame( struct frame *f)
 {
-    pthread_mutex_unlock( &currentFrame.mutex);
+    if ( !f) return;
+    log_f("released frame %u\n", f->info.serial);
+    __sync_fetch_and_sub( &f->refs, 1);
+}
+
+/*
+** The func gets the frame while we hold a reference to it, for as long as
+** it likes. Newer frames carry on arriving meanwhile.
+*/
+void with_current_frame( frame_sender func, void *arg)
+{
+    struct chunk c[4];
+    struct frame_info info;
+    struct frame *f = hold_frame( c, &info);
+
+    (*func)(c,&info,arg);
+    release_frame( f);
 }
 
 void with_next_frame( frame_sender func, void *arg)
 {
     int s;
-    int oldState;
 
     log_f("with_next_frame\n");
-    pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &oldState);
-    pthread_cleanup_push( with_next_frame_cleanup, 0);
     pthread_mutex_lock( &currentFrame.mutex);
-    pthread_setcancelstate( oldState,0);
-
     s = currentFrame.serial;
     while( currentFrame.serial == s) {
 	pthread_cond_wait( &currentFrame.cond, &currentFrame.mutex);
     }
-    pthread_cleanup_pop( 1);
+    pthread_mutex_unlock( &currentFrame.mutex);
     with_current_frame( func, arg);
 }
-
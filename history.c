@@ -0,0 +1,245 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "tinycamd.h"
+
+/*
+** The last few seconds of frames, for looking back after something has
+** happened. The images are copied, DHT and all, one after another into a
+** single arena which wraps around, so keeping a frame never costs a malloc.
+** An index, oldest first, says where each one is and when it arrived, and
+** since both the times and the serials only go up it is searched by
+** bisection.
+**
+** Everything is under historyMutex, but no reader sends with it held. A
+** reader pins the frame's bytes in the arena, lets go of the lock and sends
+** straight from there, then takes the lock again for a moment to unpin. The
+** capture thread never overwrites a pinned range, it skips the frame
+** instead, so it is never kept waiting for a client.
+**
+** Times are when a frame arrived from the camera, by CLOCK_MONOTONIC, not
+** the driver's capture timestamp, which may be on some other clock. The two
+** are only a frame or so apart.
+*/
+struct history_entry {
+    unsigned int serial;
+    unsigned int length;
+    size_t offset;           // in the arena
+    uint64_t arrived;        // ms, CLOCK_MONOTONIC
+    struct timeval timestamp;
+};
+
+static unsigned char *arena = 0;
+static size_t arenaSize = 0;
+static size_t arenaNext = 0;      // where the next frame goes, unless it has to wrap
+static uint64_t keepMs = 0;
+
+struct history_pin {         // on the reader's stack while it sends
+    size_t offset;
+    size_t length;
+    struct history_pin *next;
+};
+
+static struct history_entry *entries = 0;
+static unsigned int capacity = 0;
+static unsigned int first = 0;    // the oldest
+static unsigned int count = 0;
+static struct history_pin *pins = 0;
+
+static pthread_mutex_t historyMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct history_entry *entry( unsigned int i)
+{
+    return &entries[ (first + i) % capacity];
+}
+
+/*
+** Keep up to 'seconds' of frames, in no more than 'megabytes' of memory.
+** The arena is allocated now, the index starts at a guess and grows if the
+** camera is faster than we thought.
+*/
+void init_history( unsigned int seconds, unsigned int megabytes)
+{
+    arenaSize = (size_t)megabytes * 1024 * 1024;
+    arena = malloc( arenaSize);
+    if ( !arena) fatal_f("Failed to allocate %u MB for the history\n", megabytes);
+    keepMs = (uint64_t)seconds * 1000;
+
+    capacity = seconds * (fps > 0 ? fps : 30) * 2 + 16;
+    entries = calloc( capacity, sizeof(*entries));
+    if ( !entries) fatal_f("Failed to allocate the history index\n");
+}
+
+static void drop_oldest(void)
+{
+    first = (first + 1) % capacity;
+    count--;
+}
+
+/*
+** Make room at the end of the index, growing it if it is full. Then the
+** entries are laid out in order from the start again.
+*/
+static int grow_index(void)
+{
+    struct history_entry *e;
+    unsigned int i;
+
+    if ( count < capacity) return 1;
+
+    e = malloc( 2 * capacity * sizeof(*e));
+    if ( !e) return 0;
+    for ( i = 0; i < count; i++) e[i] = *entry(i);
+    free( entries);
+    entries = e;
+    first = 0;
+    capacity *= 2;
+    return 1;
+}
+
+static int pinned( size_t at, size_t length)
+{
+    struct history_pin *p;
+
+    for ( p = pins; p; p = p->next) {
+	if ( p->offset < at + length && at < p->offset + p->length) return 1;
+    }
+    return 0;
+}
+
+/*
+** Remember a newly published frame. From the capture thread only. If a
+** reader is still sending from where it would go the frame is left out.
+*/
+void history_add( const struct chunk *c, const struct frame_info *info)
+{
+    uint64_t now = now_ms();
+    size_t length = 0, at, next;
+    struct history_entry *e;
+    int i;
+
+    if ( !arena) return;
+
+    for ( i = 0; c[i].data; i++) length += c[i].length;
+    if ( length == 0) return;
+    if ( length > arenaSize) {
+	log_f("Frame of %zu bytes is too big for the history\n", length);
+	return;
+    }
+
+    pthread_mutex_lock( &historyMutex);
+
+    // the space from arenaNext on holds the oldest frames, in order
+    at = arenaNext;
+    if ( at + length > arenaSize) at = 0;
+    if ( pinned( at, length)) {
+	pthread_mutex_unlock( &historyMutex);
+	log_f("History frame %u skipped, a client is still reading the space\n", info->serial);
+	return;
+    }
+    if ( at == 0 && arenaNext != 0) {
+	while ( count && entry(0)->offset >= arenaNext) drop_oldest();
+    }
+    while ( count && entry(0)->offset >= at && entry(0)->offset < at + length) drop_oldest();
+    while ( count && now - entry(0)->arrived > keepMs) drop_oldest();
+
+    if ( !grow_index()) {
+	pthread_mutex_unlock( &historyMutex);
+	log_f("Failed to grow the history index\n");
+	return;
+    }
+    pthread_mutex_unlock( &historyMutex);
+
+    // nothing in the index points here now, so no reader can have it pinned
+    for ( i = 0, next = at; c[i].data; i++) {
+	memcpy( arena + next, c[i].data, c[i].length);
+	next += c[i].length;
+    }
+
+    pthread_mutex_lock( &historyMutex);
+    e = &entries[ (first + count) % capacity];
+    e->serial = info->serial;
+    e->length = length;
+    e->offset = at;
+    e->arrived = now;
+    e->timestamp = info->timestamp;
+    arenaNext = next;
+    count++;
+
+    pthread_mutex_unlock( &historyMutex);
+}
+
+/*
+** The index of the last frame which arrived at or before 'value' ms, or
+** which has a serial at or below it, -1 if there isn't one.
+*/
+static int find_entry( uint64_t value, int bySerial)
+{
+    int lo = 0, hi = count;   // the answer is below hi
+
+    while ( lo < hi) {
+	int mid = (lo + hi) / 2;
+	struct history_entry *e = entry(mid);
+
+	if ( (bySerial ? e->serial : e->arrived) <= value) lo = mid + 1;
+	else hi = mid;
+    }
+    return lo - 1;
+}
+
+/*
+** Call func with the frame which arrived 'ago' ms back, or if serial is not
+** 0 with that frame exactly. Returns 0, without calling func, if we haven't
+** got it. The func runs without the history lock, while the frame is
+** pinned, so it mustn't keep the data after it returns.
+*/
+int with_history_frame( unsigned long ago, unsigned int serial, frame_sender func, void *arg)
+{
+    struct chunk c[2];
+    struct frame_info info = { 0 };
+    struct history_entry *e;
+    struct history_pin pin, **p;
+    uint64_t now = now_ms();
+    int i;
+
+    pthread_mutex_lock( &historyMutex);
+    if ( serial) i = find_entry( serial, 1);
+    else i = ago > now ? -1 : find_entry( now - ago, 0);
+
+    if ( i < 0 || (serial && entry(i)->serial != serial)) {
+	pthread_mutex_unlock( &historyMutex);
+	return 0;
+    }
+
+    e = entry(i);
+    c[0].data = arena + e->offset;
+    c[0].length = e->length;
+    c[1].data = 0;
+    info.serial = e->serial;
+    info.timestamp = e->timestamp;
+    pin.offset = e->offset;
+    pin.length = e->length;
+    pin.next = pins;
+    pins = &pin;
+    pthread_mutex_unlock( &historyMutex);
+
+    (*func)( c, &info, arg);
+
+    pthread_mutex_lock( &historyMutex);
+    for ( p = &pins; *p != &pin; p = &(*p)->next);
+    *p = pin.next;
+    pthread_mutex_unlock( &historyMutex);
+    return 1;
+}
@@ -0,0 +1,175 @@
+const char tinycamd_js[] = "\nvar baseUrl = '';\n\nfunction loadControls( data,status) {\n  "
+                          "  var pendingChanges = {};\n    var currentRequest;\n    \n    f"
+                          "unction doneChange(xhr, status) {\n\t$('#log').text( currentRequ"
+                          "est.url + ' '+ status + '\\n' + $('#log').text());\n\tcurrentReq"
+                          "uest = false;\n\tdoChange();\n    };\n    \n    function doChang"
+                          "e() {\n\tif ( currentRequest) return;       // don't ever let mo"
+                          "re than one go.\n\t\n\tfor ( var cid in pendingChanges) {\n\t   "
+                          " currentRequest = { 'url': baseUrl+'set\?'+cid+'='+pendingChange"
+                          "s[cid],\n\t\t\t       dataType: 'text',\n\t\t\t       complete: "
+                          "doneChange };\n\t    delete pendingChanges[cid];\n\t    $.ajax( "
+                          "currentRequest);\n\t    break;  // only do the first one\n\t}\n "
+                          "   };\n    function noteChange(cid,val) {\n\tpendingChanges[''+c"
+                          "id] = val;\n\tdoChange();\n    };\n\n    function toggleRefresh("
+                          ") {\n\tif ( $(this).hasClass('on') ) {\n\t    $(this).removeClas"
+                          "s('on').addClass('off').attr('value','stopped');\n\t} else {\n\t"
+                          "    $(this).removeClass('off').addClass('on').attr('value','runn"
+                          "ing');\n\t    startRefresh();\n\t}\n    }\n\n    $('TABLE#contro"
+                          "ls').append( $('<tr>')\n\t\t\t\t.append( $('<th>').text('Refresh"
+                          "'))\n\t\t\t\t.append( $('<td>')\n\t\t\t\t\t .append( $('<input t"
+                          "ype=\"button\" class=\"off\" id=\"refresh\" value=\"stopped\">')"
+                          ".click(toggleRefresh))));\n    function doControl( ) {\n\tvar c "
+                          "= $('<tr>').append( $('<th>').text( this.getAttribute('name')));"
+                          "\n\n\tvar cid = this.getAttribute('cid');\n\tswitch( this.tagNam"
+                          "e) {\n\t  case 'range_control':\n\t    c.append( $('<td>').appen"
+                          "d( $('<input type=range>')\n\t\t\t\t\t.attr('min', this.getAttri"
+                          "bute('minimum'))\n\t\t\t\t\t.attr('max', this.getAttribute('maxi"
+                          "mum'))\n\t\t\t\t\t.attr('value', this.getAttribute('current'))\n"
+                          "\t\t\t\t\t.attr('step', this.getAttribute('by'))\n\t\t\t\t\t.att"
+                          "r('data-default', this.getAttribute('default'))\n\t\t\t\t\t.chan"
+                          "ge( function() { noteChange( cid,this.value); })));\n\t    break"
+                          ";\n\t  case 'boolean_control':\n\t    c.append( $('<td>').append"
+                          "( $('<input type=checkbox>')\n\t\t\t\t\t.attr('checked', this.ge"
+                          "tAttribute('current') != 0 \? true : false)\n\t\t\t\t\t.attr('da"
+                          "ta-default', this.getAttribute('default'))\n\t\t\t\t\t.change( f"
+                          "unction() { noteChange( cid,this.checked \? 1 : 0); })));\n\t   "
+                          " break;\n\t  case 'menu_control':\n\t    var g = $('<td>');\n\t "
+                          "   var radioname = this.getAttribute('name');\n\t    var current"
+                          " = this.getAttribute('current');\n\t    $(this).find('menu_item'"
+                          ").each( function() {\n\t\t    var index = this.getAttribute('ind"
+                          "ex');\n\t\t    var r = $('<input type=radio>')\n\t\t\t.attr('nam"
+                          "e', radioname)\n\t\t\t.attr('value', this.getAttribute('index'))"
+                          "\n\t\t\t.attr('checked', this.getAttribute('index') == current )"
+                          "\n\t\t\t.attr('data-default', this.getAttribute('default'))\n\t\t"
+                          "\t.change( function() { noteChange( cid, index); });\n\t\t    g."
+                          "append( $('<div>')\n\t\t\t      .append(r)\n\t\t\t      .append("
+                          " $('<span>').text( this.getAttribute('name'))));\n\t\t});\n\t   "
+                          " c.append(g);\n\t    break;\n\t}\n\n\tif ( c) $('TABLE#controls'"
+                          ").append( c);\n    };\n\n    $(data).find('controls').children()"
+                          ".each( doControl);\n}\n\nvar refreshRunning = false;\n\nfunction"
+                          " startRefresh()\n{\n    if ( refreshRunning) return;\n\n    var "
+                          "serial = (new Date).getTime();\n    var nth = 0;\n    var theIma"
+                          "ge = $('<img>').load(gotImage);\n\n    function loadNext() {\n\t"
+                          "$(theImage).attr('src', baseUrl+'image.jpg'+'\?'+serial+'.'+nth+"
+                          "+);\n    }\n    \n    function gotImage() {\n\t$('IMG#picture')["
+                          "0].src = $(theImage)[0].src;\n\t\n\tif ( $('INPUT#refresh').hasC"
+                          "lass('on') ) setTimeout( loadNext, 100);\n\telse refreshRunning "
+                          "= false;\n    };\n    loadNext();\n}\n\n$(document).ready( funct"
+                          "ion() {\n\t// load the controls\n\t$.ajax( {url: baseUrl+'contro"
+                          "ls',\n\t\t    dataType: 'xml',\n\t\t    success: function ( data"
+                          ",status) { $(document).ready( function() { loadControls( data,st"
+                          "atus); }) } });\n    });\n";
+const int tinycamd_js_size = sizeof(tinycamd_js)-1;
+const char tinycamd_js_gz[] = "\037\213\010\000\000\000\000\000\002\003\275W[o\3336\024~\226~\005"
+                             "\353\004\240\004y\256\373\032\315-\272l\030\002l\301\020\244O]P\320"
+                             "\022-\253\221H\215\244R\007\201\377\373\016o\272Y\361:\014\230\037"
+                             "\022\230\347\376\235s\310\317\341\023\021hK$\375$*\264A\030\247a"
+                             "\270kY\246J\316P\305I~\315\231\022\274\222\021\312\211\"K\251\210"
+                             "je\214^B\004\037m\334P\226\227\254\270\336\023VP\t>^\216i'\314Z!"
+                             "(Sw\364\257\226Je\317\315\237.F\316\031\265\266\321a/\226\250\017"
+                             "\020\\F\370\242\342\005\216W\212\036T4q\266j!\343\004a\204\023g\244"
+                             "\277\375\3110\374\233X\306q\032\006ck\310sG*IA\220s\027\?\266\371"
+                             "\035\347\323\364J:\263r\207\246\351\304HP\325\n\226\"\373y\373V\227"
+                             "\206\025\242OT\240\212*TsA\221\002/\010JF\005_\205A\030\354\270\000"
+                             "W\006\2522G%\233\300i\242iw'\331\277 \014\000\340+\337\274\004K\252"
+                             ">\340\004\334$x\203\223\261\237\317p\374\260\014\203 p\351\351f\336"
+                             "\?7\364\na\r\021\036\3122^7\2200\310\372\346hT\214<\247Z\204f\334"
+                             ";\205\313\025\371J\016'\3608\351VP\362\230\032x8\253\236!\002@B\321"
+                             "\256\024P\025D\013\203\343\260\t\035\376\214+\?&\020k\371D*\003\315"
+                             "$\rl\352\177\000x@a\276\265c\267\212\027EE\357\350NP\271\037\364"
+                             "\3662R\373R\306\253=\221\327\025\2212\302\320\313\030u\355\360rA"
+                             "k\376D\007*+\222\347\376\353n\247\277+%\"\014\351\264\024/\261T\274"
+                             "ih\2165\034GDa\000\317{\264.z\227\354\304\243h\031\003\004\260\007"
+                             "\030VA\250\256\240\264\303\323\026\016\213q\377\361\247\337~\271"
+                             "\310\334Zk\177\215FQ\327\214\177T\342=\216\365(\004\343\343\375{"
+                             "\277K\330\371\306\361\234^\356\315\0034\022\224\254i\025R0p\233\305"
+                             "\266U\212\263\005\312tM\233\005\324\270@e\276Y\010\353x\201Li\233"
+                             "\205\303j\241CgU\231=F\243n\305q\034\247'Kj\313\212l\247\314Z\301"
+                             "0t\225\275V\024\322\330\257\n\252>\002\266%$H#\314HM\261\211\341"
+                             "\034\301~n\346\024A`\320\227\337J\225\355\235/E\212[p\340\006&\203"
+                             "\035EX\350Q\374\342\220\307Wn\261O\001|\r9c\337\001\354\346\240."
+                             "\031^\316\245\005\202\262nk\337\247N\237\034^\321'\2079}7g\263\205"
+                             "\333\r\237ZHE\233y\203\355\363TW_C\?\344tG\332J\315\333xag\230\331"
+                             "\215\356\272\256\267vx=\350F-\215#\223z\234\242\243\351\342\340\372"
+                             "\351[\262\345\274\242\204\375\207\246d{\232=n\371a\332\027s\016\233"
+                             "~\0369\364f\203\326\350\003R\242\245\350\312>I\377#B.IH\340\035D"
+                             "_\237\307\252\246\254\235\002\245\027\243\360\033\246aJ\373sAr\010"
+                             "\016K0\2776v\277\006\372\016\224W\226\314#\226\216\257\313]\t=\261"
+                             "\251\225\212\302\364\256(\321K8\254=\014\272\030\240M\017\363\021"
+                             "\214\310\370\357+p\225\215v\020\212r\275v\0352\205,\373r\207\262"
+                             "3\333\343\342\r\265\317\316\214\323G\233M\207\324\320\366\337\316"
+                             "\311\367M\211\005\314\314\205\007\246\030mB^>94,w\360B1sf\014dC\330"
+                             "w\335\273&\340\321\367\273\333\310b:\236\360\2629>\026\237}\336\262"
+                             "\t\007\270\2144d~\202\006\006\331\276\254r\3007\362\263\324=+\340"
+                             "\001\242\231\311\260o\320\235}|{2\331s\347\361;\034Z\276l\362\034"
+                             "\333v\2741\354H\263\244\242$\232\215G\214~C\?\023Ec\215\321}YwDF"
+                             "\2531\265\007\235u\177\000D\352\246&\005\365S[\027\032hM\342\243"
+                             "\202+#\212\247\004HKo\rG\266\214\333\373\3604C\212\014\246\251\343"
+                             "\230\245\226\255\2766\005N0\220M\233i\202W8\201l\222\304C<C\240}"
+                             "\006>\020\276\371\375\327\213\246\314\240vh\367\347\365\303\nB\231"
+                             "\314\273\024\334a\252y\262ce\370\346\366\217O\367\027\302s\220S\202"
+                             "&-P\274\205\351\362\305-\321\273\365Z\317\215!\\\257\365n@;{TL\307"
+                             "aTx\326\302%\2434\?#\371\363\364~\0016\253M\014\225\365\223\004E"
+                             ":&\374\002D}\300\323\273Q[\272\215\032p\361C]u\307\262\3152*\345"
+                             "U\217\341\3647\030\372\207\304\316\374\200\323\033\215\216f\255M"
+                             "\335\360\377o\342\037\321&\013\016\000\000";
+const int tinycamd_js_gz_size = sizeof(tinycamd_js_gz)-1;
+const char tinycamd_js_hash[] = "294aa4625251a268";
+
+const char tinycamd_css[] = "HTML {\n  background: hsl(240,80%,10%);\n}\n\nBODY {\n  margin: "
+                           "1em auto;\n  padding: 0;\n}\n\nDIV#pictureframe {\n  margin: 0 a"
+                           "uto;\n}\n\nINPUT#refresh {\n  width: 100px;\n}\nINPUT.on {\n  ba"
+                           "ckground: hsla(120,90%,75%,0.6);\n}\nINPUT.off {\n  background: "
+                           "hsla(0,70%,75%,0.6);\n}\n\nIMG#picture {\n  display: block;\n  m"
+                           "argin: 0 auto;\n}\n\nTABLE#controls {\n  display: block;\n  marg"
+                           "in: 0 auto;\n  width: 480px;\n  background: hsla(0,0%,100%,0.75)"
+                           ";\n  padding: 0 1em;\n}\n\nTABLE#controls TH {\n  text-align: ri"
+                           "ght;\n  font-weight: normal;\n  font-family: sans-serif;\n}\n\nP"
+                           "RE#log {\n  margin: 2em;\n  background: white;\n  color: black;\n"
+                           "}\n";
+const int tinycamd_css_size = sizeof(tinycamd_css)-1;
+const char tinycamd_css_gz[] = "\037\213\010\000\000\000\000\000\002\003\215\221\321j\3020\024\206"
+                              "\357\373\024\201RPh%\026]]{5Q\246\240\233\214n\260\313\330&m0MJ\222"
+                              "\242c\370\356K\302&\353\350\305.s\370\376s\276s\262\311\367;\360"
+                              "\351\001pD\305\251\222\242\343e\nj\305F\361\014\206\013\030\204S"
+                              "\030\2143\357\352y\313\347\325\273#\033$+\312S0\305\r@\235\026\231"
+                              "\251\265\250,)\257R\000\035\273\332\276\371--t'1\221\250\301\275"
+                              "\034\374N\031n\373tx\315}\013aU;\350LK]\233\336\020\266\027\2138"
+                              "b\"\370\220#\032Mc\030\336\033\311d\036\204pr7\376\225 d8\002\303"
+                              "\344O\300\333\356\037\177l]\246\244\252e\350#\005G&\212S6\254\236"
+                              "\?,wk\277\020\\K\301\324\?s\267\375f\013\267\337\240\237;:\264~\311"
+                              "|\334\?\256\275\371\320\364|\343\0044\276\350\0101Z\231\221\222V"
+                              "\265\266ib\240\350\214\3553\005\\\310\006\261[\231\240\2062#\254"
+                              "\020W\221\302\222\022\327\375\360\262\366\231\250z\277\026\333\311"
+                              "}\337sM5\266\305B0!\355\332\310\256}\365\276\000\251v(\371U\002\000"
+                              "\000";
+const int tinycamd_css_gz_size = sizeof(tinycamd_css_gz)-1;
+const char tinycamd_css_hash[] = "f00c035a9f02089a";
+
+const char setup_html[] = "<!DOCTYPE html>\n<html>\n  <head>\n    <title>Camera Test</title"
+                         ">\n    <link rel=stylesheet href=\"tinycamd.css\?v=f00c035a9f020"
+                         "89a\" type=\"text/css\" />\n    <script src=\"http://ajax.google"
+                         "apis.com/ajax/libs/jquery/1.4.3/jquery.min.js\" type=\"text/java"
+                         "script\"></script>\n    <script src=\"tinycamd.js\?v=294aa462525"
+                         "1a268\" type=\"text/javascript\" charset=\"utf-8\"></script>\n  "
+                         "</head>\n  <body>\n    <div id=pictureframe><img id=picture></di"
+                         "v>\n    <table id=controls></table>\n    <pre id=log></pre>\n  <"
+                         "/body>\n</html>\n";
+const int setup_html_size = sizeof(setup_html)-1;
+const char setup_html_gz[] = "\037\213\010\000\000\000\000\000\002\003uQ\313R\3030\014\274\363"
+                            "\025&w\3544}L\3138\341P8\303\241\027\216\252\243$\016N\034l\265\323"
+                            "\374=n\23420\003'I\273\232\335\035I\336\?\277\356\017\357o/\254\241"
+                            "\316\024w2\026\306d\203P^\233\320\222&\203\305\036:t\300\016\350"
+                            "I\212\010E\332\350\376\20394\271\247\321\240o\020\2115\016\253<!"
+                            "\335\217\n\272\222+\357\237\316y\225\246*]\256aW\245Y\272\335A\302"
+                            "h\0340\254\341\205DXI\230\230%\275rz \346\235\312\223\206hx\024\002"
+                            "Z\270\360\332\332\332 \014\332se\273\t\023F\037\275h\?O\350F\261"
+                            "\340+\276\234\007\336\351\236\267\376\227I\013g\210\332I!E\354\376"
+                            "\260\374\316\335^cg\273\025\300j\223\255\263\365\002\262\315\366"
+                            "\?E\246\032p\036)ONT=l\177;Hq;\250<\332r\234MK}f\272\314\007\255"
+                            "\350\024.\346\302\211\013\251\273\372\007\030T\302\326\355\023p4"
+                            "x%\225\355\311Y\343\003;a3\?\270\2115\266\016D\030\242s4\014\t\246"
+                            "\337~\001V\375i\355\363\001\000\000";
+const int setup_html_gz_size = sizeof(setup_html_gz)-1;
+const char setup_html_hash[] = "28608afe183ee568";
+
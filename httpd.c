@@ -1,5 +1,7 @@
+#define _GNU_SOURCE   // for accept4()
 
 #include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -7,156 +9,675 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdint.h>
+#ifdef HTTPD_IO_URING
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "httpd.h"
 #include "logging.h"
 
-#define MAX_HTTPD_CONNECTIONS 16
-#define MAX_HTTPD_TIMEOUT 10
-#define MAX_HTTPD_LISTEN_BACKLOG 24
+#define MAX_HTTPD_CONNECTIONS 1024     // defaults, see HTTPD_Set_Limits()
+#define MAX_HTTPD_STREAMS 64
+#define MAX_HTTPD_IDLE_TIMEOUT 15      // keep alive connection waiting for a request
+#define MAX_HTTPD_HEADER_TIMEOUT 10    // from the first byte of a request to the end of its headers
+#define MAX_HTTPD_WRITE_TIMEOUT 10     // without the client taking any of our output
+#define MAX_HTTPD_STREAM_IDLE 60       // stream waiting for a frame
+#define MAX_HTTPD_WAIT 60              // the longest HTTPD_Wait(), the wheel must cover it and a second more
+#define MAX_HTTPD_WHEEL 64             // seconds, must exceed every timeout above
+#define MAX_HTTPD_LISTEN_BACKLOG 128
+#define MAX_HTTPD_EVENTS 64
+#define MAX_HTTPD_HEADER_SIZE 8192
+#define MAX_HTTPD_HEADERS 32
+#define MAX_HTTPD_CHUNKS 16
+#define MAX_HTTPD_RESPONSE_HEADER 512
+#define MAX_HTTPD_HELD 8               // pipelined responses coalesced into one send
+#define MAX_HTTPD_COALESCE 8192        // bytes of them
+#define MAX_HTTPD_CHUNK_BUFFER 4096    // small body chunks gathered before they go out
+#define MAX_HTTPD_WEBSOCKET_KEY 64
+#define MAX_HTTPD_RING 256             // io_uring submissions queued at once
+#define MAX_HTTPD_RING_COMPLETIONS 4096
+#define MAX_HTTPD_FASTCGI_IDLE 62      // web server connection with nothing to do, longer than any wait
+#define MAX_HTTPD_FASTCGI_REQUESTS 64  // at once on one web server connection
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// FastCGI record types, roles, flags and statuses, from the specification.
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_DATA 8
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE 11
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_OVERLOADED 2
+#define FCGI_UNKNOWN_ROLE 3
 
 
 typedef void *(*Pfunc)(void *);  // make the pthread_create calls tidier
 
+#ifdef HTTPD_IO_URING
+//
+// Our side of an io_uring, mapped by ring_setup(). fd is -1 if the kernel
+// wouldn't give us one, and we use epoll instead.
+//
+struct ring {
+    int fd;
+    unsigned int *sqHead, *sqTail, *sqArray;
+    unsigned int sqMask, sqEntries;
+    struct io_uring_sqe *sqes;
+    unsigned int *cqHead, *cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned int pending;        // submissions the kernel hasn't seen yet
+};
+#endif
+
 static const int zero = 0;
 static const int one = 1;
 
 struct httpd {
     pthread_t thread;
-    sem_t counter;
+    int cpu;                    // -1 for wherever the scheduler likes
     struct addrinfo *bindAddr;
     const char *bindName;
     void (*func)(HTTPD_Request req, const char *method, const char *url);
     int sock;
+    int tcp;                    // not a unix socket, so there is TCP_CORK to manage
+    int fastcgi;                // web servers talking FastCGI connect here, not browsers
+    int spare;                  // a descriptor to give up when accept() runs out, -1 if we have none
+    int acceptPaused;           // out of descriptors altogether, accept again in a second
+    int epoll;
+    int wake;                   // eventfd poked by HTTPD_Wake_Streams()
+    struct http_request *streams;   // and requests waiting for a frame
+
+    // Requests the workers have finished with, to be picked up by the listener.
+    int resume;                 // eventfd poked by the workers
+    pthread_mutex_t resumeMutex;
+    struct http_request *resumed;
+
+    // Every connection has a deadline and sits in the slot of the wheel for that second.
+    time_t wheelTime;           // every slot up to here has been expired
+    struct http_request *wheel[MAX_HTTPD_WHEEL];
+    uint64_t waitDue;           // ms, the earliest a waiting request may be due, 0 if none
+    struct httpd *nextHttpd;
+
+#ifdef HTTPD_IO_URING
+    struct ring ring;
+    struct http_request *arming;   // connections whose poll needs (re)submitting
+    struct __kernel_timespec tick;
+    struct __kernel_timespec waitTimer;   // absolute, for waitDue
+    int acceptPolled;              // no multishot accept, poll the socket instead
+#endif
+};
+
+//
+// Admission control. Over these limits we answer with a canned 503 rather than
+// make anyone wait. The counts are shared by every httpd.
+//
+static int maxConnections = MAX_HTTPD_CONNECTIONS;
+static int maxStreams = MAX_HTTPD_STREAMS;
+static int listenerCount = 1;
+static int listenerAffinity = 0;
+static int socketMode = 0666;
+static struct httpd_stats stats;
+
+//
+// With workers, handlers run on them rather than on the listeners. Requests
+// wait their turn in this queue.
+//
+static int workerCount = 0;
+static struct http_request *workHead = 0, **workTail = &workHead;
+static pthread_mutex_t workMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+
+static const char busyResponse[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Retry-After: 5\r\n"
+    "Connection: close\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 16\r\n"
+    "\r\n"
+    "503 - Try later\n";
+
+//
+// Every running httpd, so HTTPD_Wake_Streams() can find them from the capture thread.
+//
+static struct httpd *httpds = 0;
+static pthread_mutex_t httpdsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Output that could not be sent immediately waits here until the socket
+// is writable again. Each piece is a private copy of the data, or for
+// HTTPD_Send_File() our own dup() of the file with offset and length
+// being positions in it.
+//
+struct out_buf {
+    struct out_buf *next;
+    unsigned int length;
+    unsigned int offset;
+    int fd;                 // -1 unless this is a piece of file
+    char data[];
+};
+
+static void free_out( struct out_buf *o)
+{
+    if ( o->fd >= 0) close( o->fd);
+    free(o);
+}
+
+enum conn_state {
+    CONN_READING,     // waiting for a complete request
+    CONN_WRITING,     // response queued, waiting for the socket to drain
+    CONN_STREAMING,   // headers sent, waiting for new frames to push
+    CONN_WAITING,     // handler parked until the next frame or its deadline
+    CONN_HANDLING,    // a worker has it, the listener keeps its hands off
+    CONN_CLOSING,     // finished or failed, close at the next opportunity
+    CONN_CLOSED,      // cleaned up, but io_uring still has a poll for it
 };
 
+//
+// One of these per connection. There is no thread behind it, the listener
+// moves it between states as the socket becomes readable or writable.
+//
 struct http_request {
     struct httpd *httpd;
-    pthread_t thread;
-    timer_t watchdog;
-    struct sockaddr_in remote_addr;
+    struct http_request *timerNext, *timerPrev;
+    struct http_request *streamNext, *streamPrev;   // streams and waiters both
+    enum conn_state state;
+    time_t deadline;
+    struct sockaddr_storage remote_addr;
     int protocol;    // 0x10 = 1.0, 0x11 = 1.1
+    int keepAlive;
+    int eof;         // the client has finished sending
     int socket;
+    unsigned int events;   // what we last asked epoll to watch for
     int sentStatus;
+    unsigned int headUsed;   // response status and headers not yet sent
+    int coalesce;            // another complete request is already waiting behind this one
+    int held;                // responses at the front of 'out' which we haven't tried to send
+    unsigned int heldBytes;
+    int chunked;             // body going out in pieces, 1 chunked, -1 raw until we close for HTTP/1.0
+    char *chunkBuf;          // MAX_HTTPD_CHUNK_BUFFER, allocated the first time it is needed
+    unsigned int chunkUsed;
+    char head[MAX_HTTPD_RESPONSE_HEADER];
     void (*func)(HTTPD_Request req, const char *method, const char *url);
-    char authorization[1024];
+    void (*streamFunc)(HTTPD_Request req);
+    int framePending;          // a frame came while we were still sending the last
+    unsigned long dropped;     // frames this stream never sent because a newer one came
+    int paused;
+    unsigned int frameInterval;   // ms, 0 to send every frame
+    uint64_t lastFrame;           // ms, when we last sent one
+    int streamEnded;              // the stream func has nothing more, close once the output drains
+    void *streamContext;          // the handler's, free()d with the request
+    void (*messageFunc)(HTTPD_Request req, const char *data, int length);   // set for a WebSocket
+    int (*waitFunc)(HTTPD_Request req, int expired);
+    unsigned long waitMs;
+    uint64_t waitUntil;           // ms, when the wait times out
+    unsigned int pendingLength;   // of a request being handled or parked, still at the front of 'in'
+    struct http_request *workNext;   // in the work queue, or the httpd's resumed list
+    struct out_buf *out, **outTail;
+    const char *authorization;    // decoded over the Authorization header, so only good while 'in' is
+
+    //
+    // FastCGI. A connection from the web server is a parent, and carries any
+    // number of requests at once. Each is a child, with no socket of its own,
+    // whose response goes back to the web server in records on the parent.
+    //
+    int fastcgi;                      // a parent
+    struct http_request *children;
+    int recType;                      // the PARAMS or STDIN record we are part way through
+    unsigned int recId, recLeft, recPad;
+    struct http_request *parent;      // a child
+    struct http_request *childNext;
+    unsigned int requestId;
+    int keepConn;                     // the web server wants the parent left open after this one
+    int tooBig;                       // the params didn't fit in 'in'
+
+#ifdef HTTPD_IO_URING
+    // Only the listener touches these.
+    int polling;                 // a poll is in the ring for us, with armedEvents
+    unsigned int armedEvents;
+    int armPending;              // on the httpd's arming list
+    struct http_request *armNext;
+#endif
+
+    // Set by the listener when it hands the request to a worker, and cleared
+    // when it takes it back. Meanwhile the listener ignores its events, and
+    // the worker never changes 'state', it only notes a failed send.
+    int working;
+    int failed;
+
+    // The request being read. The strings all point into 'in', which is only
+    // allocated while there is something in it, so an idle connection
+    // doesn't keep MAX_HTTPD_HEADER_SIZE.
+    char *method;
+    char *url;
+    int nHeaders;
+    struct {
+	const char *name;
+	const char *value;
+    } headers[MAX_HTTPD_HEADERS];
+    unsigned int parsed;   // bytes of 'in' already split into lines
+    unsigned int inUsed;
+    char *in;
 };
 
 const int noKeepAlive = 0;
 
+static int Send_Vector( HTTPD_Request req, const struct iovec *pieces, int count);
+static void process_input( HTTPD_Request req);
+static void fastcgi_watch( HTTPD_Request req);
+static void set_wait_deadline( HTTPD_Request req);
 
-static int set_deadline( HTTPD_Request req, unsigned int seconds) {
-    struct itimerspec its = { .it_value = { .tv_sec = seconds } };
-    if ( timer_settime( req->watchdog, 0, &its, 0) == -1) {
-	log_f("Failed timer_settime in set_deadline: %s\n", strerror(errno));
-	return 0;
+
+static time_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void cancel_deadline( HTTPD_Request req)
+{
+    struct httpd *httpd = req->httpd;
+
+    if ( req->timerPrev) req->timerPrev->timerNext = req->timerNext;
+    else if ( httpd->wheel[req->deadline % MAX_HTTPD_WHEEL] == req) {
+	httpd->wheel[req->deadline % MAX_HTTPD_WHEEL] = req->timerNext;
     }
-    return 1;
+    if ( req->timerNext) req->timerNext->timerPrev = req->timerPrev;
+    req->timerNext = req->timerPrev = 0;
 }
+
 //
-// Fired by the watchdog to kill an idle or hung thread.
-// This runs in a different thread from the request.
+// Move the connection to the wheel slot for its new deadline. Nothing is
+// armed in the kernel, the listener expires whole slots as the clock passes them.
 //
-static void expire_request( union sigval arg) 
+static void set_deadline( HTTPD_Request req, unsigned int seconds)
 {
-    HTTPD_Request req = (HTTPD_Request)(arg.sival_ptr);
+    struct httpd *httpd = req->httpd;
+    time_t t = now() + seconds;
+    struct http_request **slot;
+
+    if ( req->deadline == t) return;
+    cancel_deadline(req);
+
+    req->deadline = t;
+    slot = &httpd->wheel[t % MAX_HTTPD_WHEEL];
+    req->timerNext = *slot;
+    if ( req->timerNext) req->timerNext->timerPrev = req;
+    *slot = req;
+}
 
-    //
-    // DANGER!!! There is a race here. We could have fired and gotten to here
-    //           at the same time request could have exitted and req is released
-    //           and req->thread is dead.
-    // FIX THIS!!!
-    //
-    if ( pthread_cancel( req->thread) != 0) {
-	log_f("Watchdog failed canceling request thread: %s\n", strerror(errno));
+#ifdef HTTPD_IO_URING
+//
+// The io_uring listener. The connections are still run by readiness, as
+// with epoll, but the readiness arrives as completions of one shot polls,
+// and every poll we arm, or re-arm after it fires, is queued and goes to
+// the kernel in the same io_uring_enter() that waits for the next batch.
+// New connections come from a multishot accept, one completion each, with
+// no accept() calls at all. The receives and sends stay ordinary
+// non-blocking calls, because responses point into frames and buffers that
+// are only ours until the handler returns.
+//
+// No liburing, just the raw system calls. Nothing here runs unless
+// ring_setup() succeeds, otherwise the listener uses epoll.
+//
+static int ring_setup( struct ring *ring)
+{
+    struct io_uring_params p = { .flags = IORING_SETUP_CQSIZE, .cq_entries = MAX_HTTPD_RING_COMPLETIONS };
+    static const int needed[] = { IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_ACCEPT, IORING_OP_TIMEOUT };
+    struct io_uring_probe *probe;
+    size_t sqSize, cqSize;
+    char *sq;
+    unsigned int i;
+
+    ring->fd = syscall( __NR_io_uring_setup, MAX_HTTPD_RING, &p);
+    if ( ring->fd == -1) {
+	log_f("No io_uring for HTTPD, using epoll: %s\n", strerror(errno));
+	return -1;
+    }
+
+    // One mapping for both rings (5.4) and no dropped completions (5.5) keep this simple.
+    if ( (p.features & (IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP)) != (IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP)) {
+	log_f("io_uring too old for HTTPD, using epoll\n");
+	goto fail;
+    }
+
+    probe = calloc( 1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if ( !probe || syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+	log_f("Failed to probe io_uring for HTTPD, using epoll\n");
+	free(probe);
+	goto fail;
+    }
+    for ( i = 0; i < sizeof(needed)/sizeof(needed[0]); i++) {
+	if ( needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+	    log_f("io_uring lacks operation %d for HTTPD, using epoll\n", needed[i]);
+	    free(probe);
+	    goto fail;
+	}
+    }
+    free(probe);
+
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq = mmap( 0, sqSize > cqSize ? sqSize : cqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if ( sq == MAP_FAILED) {
+	log_f("Failed to map io_uring for HTTPD: %s\n", strerror(errno));
+	goto fail;
     }
+    ring->sqes = mmap( 0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if ( ring->sqes == MAP_FAILED) {
+	log_f("Failed to map io_uring submissions for HTTPD: %s\n", strerror(errno));
+	munmap( sq, sqSize > cqSize ? sqSize : cqSize);
+	goto fail;
+    }
+
+    ring->sqHead = (unsigned int *)(sq + p.sq_off.head);
+    ring->sqTail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sqArray = (unsigned int *)(sq + p.sq_off.array);
+    ring->sqMask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sqEntries = p.sq_entries;
+    ring->cqHead = (unsigned int *)(sq + p.cq_off.head);
+    ring->cqTail = (unsigned int *)(sq + p.cq_off.tail);
+    ring->cqMask = *(unsigned int *)(sq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+    ring->pending = 0;
+    log_f("HTTPD using io_uring\n");
+    return 0;
+
+  fail:
+    close( ring->fd);
+    ring->fd = -1;
+    return -1;
 }
+
 //
-// Wherein we start the watchdog thread. This is insanely verbose because
-// pthreads condition variables are ridiculous, but we have to make sure
-// the watchdog is good and going before we come back, or we can handle
-// the request and get to the shutdown code before the watchdog has started
-// and that hangs.
+// Hand the kernel our queued submissions, and with wait, sleep until at
+// least one completion is ready.
 //
-static int start_watchdog( HTTPD_Request req)
+static int ring_enter( struct ring *ring, int wait)
 {
-    struct sigevent ev = { .sigev_notify = SIGEV_THREAD,
-			   .sigev_notify_function = expire_request,
-			   .sigev_value = { .sival_ptr = (void *)req },
-    };
+    int r = syscall( __NR_io_uring_enter, ring->fd, ring->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
 
-    if ( timer_create( CLOCK_MONOTONIC, &ev, &req->watchdog) != 0) {
-	log_f("Failed to create watchdog for request thread: %s\n", strerror(errno));
-	return 0;
-    }
-    return set_deadline( req, MAX_HTTPD_TIMEOUT);
+    if ( r >= 0) ring->pending -= r;
+    else if ( errno == EBUSY || errno == EAGAIN) r = 0;   // completions to reap first
+    return r;
 }
-static void stop_watchdog( HTTPD_Request req)
+
+//
+// The next free submission, zeroed. It is counted as queued right away,
+// which is fine since the kernel only looks in io_uring_enter().
+//
+static struct io_uring_sqe *ring_sqe( struct ring *ring)
 {
-    if ( timer_delete( req->watchdog) != 0) {
-	log_f("Failed to stop watchdog: %s\n", strerror(errno));
+    unsigned int tail = *ring->sqTail;
+    struct io_uring_sqe *sqe;
+
+    while ( tail - __atomic_load_n( ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+	if ( ring_enter( ring, 0) == -1 && errno != EINTR) {
+	    log_f("Failed to submit to io_uring for HTTPD: %s\n", strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
     }
+    sqe = &ring->sqes[tail & ring->sqMask];
+    memset( sqe, 0, sizeof(*sqe));
+    ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+    __atomic_store_n( ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+static void ring_poll( struct httpd *httpd, int fd, unsigned int events, void *tag)
+{
+    struct io_uring_sqe *sqe = ring_sqe( &httpd->ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);   // the kernel reads it as two 16 bit halves
+#endif
+    sqe->poll32_events = events;
+    sqe->user_data = (uintptr_t)tag;
+}
+
+static void ring_cancel( struct httpd *httpd, void *tag)
+{
+    struct io_uring_sqe *sqe = ring_sqe( &httpd->ring);
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)tag;
+    sqe->user_data = 0;   // its own completion is of no interest
+}
+
+static void ring_accept( struct httpd *httpd)
+{
+    struct io_uring_sqe *sqe = ring_sqe( &httpd->ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = httpd->sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t)&httpd->sock;
 }
 
 //
-// This the the request cleanup function. It could be called from either request()'s thread or
-// the request_watchdog() thread. The req->kill mutex ensures that only one gets into the goodies.
-// The other is killed and joined before the cleanup begins.
+// Wake for the earliest wait, which may well be before the next tick.
 //
-static void cleanup_request( void *arg)
+static void ring_wait_timer( struct httpd *httpd)
 {
-    HTTPD_Request req = (HTTPD_Request)arg;
+    struct io_uring_sqe *sqe = ring_sqe( &httpd->ring);
+
+    httpd->waitTimer.tv_sec = httpd->waitDue / 1000;
+    httpd->waitTimer.tv_nsec = (httpd->waitDue % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&httpd->waitTimer;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = (uintptr_t)&httpd->waitTimer;
+}
 
-    stop_watchdog(req);
+//
+// Once a second, so the wheel turns even when nothing is happening.
+//
+static void ring_tick( struct httpd *httpd)
+{
+    struct io_uring_sqe *sqe = ring_sqe( &httpd->ring);
+
+    httpd->tick.tv_sec = 1;
+    httpd->tick.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&httpd->tick;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)&httpd->tick;
+}
 
-    log_f("Shutting down sockets\n");
-    
-    shutdown( req->socket,SHUT_RDWR);
-    close( req->socket);
-	
-    sem_post( &req->httpd->counter);
+//
+// Submit polls for the connections whose events changed or whose poll
+// fired. One with a poll of the wrong events has it cancelled, and is
+// armed again when the cancellation comes back.
+//
+static void arm_requests( struct httpd *httpd)
+{
+    while ( httpd->arming) {
+	struct http_request *r = httpd->arming;
+
+	httpd->arming = r->armNext;
+	r->armPending = 0;
+	if ( r->state == CONN_CLOSED) {
+	    if ( !r->polling) free(r);
+	    continue;
+	}
+	if ( r->working) continue;
+	if ( r->polling) {
+	    if ( r->armedEvents != r->events) ring_cancel( httpd, r);
+	    continue;
+	}
+	r->polling = 1;
+	r->armedEvents = r->events;
+	ring_poll( httpd, r->socket, r->events, r);
+    }
+}
+#endif
+
+static void watch_request( HTTPD_Request req, unsigned int events)
+{
+    struct epoll_event ev = { .events = events, .data = { .ptr = req } };
+
+#ifdef HTTPD_IO_URING
+    if ( req->httpd->ring.fd >= 0) {
+	req->events = events;
+	if ( !req->armPending) {
+	    req->armPending = 1;
+	    req->armNext = req->httpd->arming;
+	    req->httpd->arming = req;
+	}
+	return;
+    }
+#endif
+    if ( req->events == events) return;
+    req->events = events;
+    if ( epoll_ctl( req->httpd->epoll, EPOLL_CTL_MOD, req->socket, &ev) == -1) {
+	log_f("Failed to modify epoll for request: %s\n", strerror(errno));
+	req->state = CONN_CLOSING;
+    }
+}
+
+static void link_stream( HTTPD_Request req)
+{
+    struct httpd *httpd = req->httpd;
+
+    req->streamPrev = 0;
+    req->streamNext = httpd->streams;
+    if ( req->streamNext) req->streamNext->streamPrev = req;
+    httpd->streams = req;
 }
 
+static void unlink_stream( HTTPD_Request req)
+{
+    struct httpd *httpd = req->httpd;
+
+    if ( req->streamPrev || httpd->streams == req) {
+	if ( req->streamPrev) req->streamPrev->streamNext = req->streamNext;
+	else httpd->streams = req->streamNext;
+	if ( req->streamNext) req->streamNext->streamPrev = req->streamPrev;
+    }
+    req->streamNext = req->streamPrev = 0;
+}
 
+static void free_child( HTTPD_Request req)
+{
+    cancel_deadline(req);
+    unlink_stream(req);
+    free( req->chunkBuf);
+    free( req->in);
+    free(req);
+}
 
 //
-// Sort of an fgets() for a socket. I had originally used fdopen() and fgets, but
-// there is some evil interraction when you pthread_cancel() a thread that is inside
-// an fgets. You can't then fclose() the FILE * from the other thread.
-// This is simple, but a lot of system calls. Maybe I should make a 1500 byte buffer.
+// This the the request cleanup function. It drops any unsent output, closes the
+// socket (which also takes it out of the epoll set) and releases the slot.
 //
-static char *sgets(char *sbuf, int size, int sock)
+// A FastCGI child only has to come off its parent. The parent isn't freed
+// from here even if it failed, because the caller may be walking a list it
+// is on, so the wheel gets it in a second.
+//
+static void cleanup_request( HTTPD_Request req)
 {
-    int togo = size;
-    char *s = sbuf;
+    if ( req->parent) {
+	struct http_request *parent = req->parent, **c;
 
-    errno = 0;
-    while( togo >1) {
-	int e;
-	do {
-	    e = recv( sock, s, 1, 0);
-	    if ( e == -1 && errno == EINTR) continue;
-	} while(0);
-	
-	if ( e == 0) {
-	    if ( s == sbuf) return 0;  // eof and no characters, return a 0
-	    break;
+	for ( c = &parent->children; *c != req; c = &(*c)->childNext) ;
+	*c = req->childNext;
+	if ( !req->keepConn) parent->keepAlive = 0;
+	free_child( req);
+
+	if ( parent->state == CONN_CLOSING) set_deadline( parent, 1);
+	else fastcgi_watch( parent);
+	return;
+    }
+
+    log_f("Shutting down sockets\n");
+
+    while( req->children) {
+	struct http_request *c = req->children;
+
+	req->children = c->childNext;
+	free_child( c);
+    }
+
+    while( req->out) {
+	struct out_buf *o = req->out;
+	req->out = o->next;
+	free_out(o);
+    }
+
+    shutdown( req->socket,SHUT_RDWR);
+    close( req->socket);
+
+    cancel_deadline(req);
+    __sync_fetch_and_sub( &stats.connections, 1);
+
+    unlink_stream(req);
+    free( req->chunkBuf);
+    free( req->in);
+    req->in = 0;
+    free( req->streamContext);
+    if ( req->streamFunc) {
+	char addr[INET_ADDRSTRLEN] = "the unix socket";
+
+	if ( req->remote_addr.ss_family == AF_INET) {
+	    inet_ntop( AF_INET, &((struct sockaddr_in *)&req->remote_addr)->sin_addr, addr, sizeof(addr));
 	}
-	if ( e == -1) return 0;
-        s++;
-	togo--;
-	if ( s[-1] == '\n') break;
+	log_f("Stream from %s ended, %lu frames dropped\n", addr, req->dropped);
+	__sync_fetch_and_sub( &stats.streams, 1);
+    }
+
+#ifdef HTTPD_IO_URING
+    if ( req->polling || req->armPending) {   // freed when the ring lets go of it
+	if ( req->polling) ring_cancel( req->httpd, req);
+	req->state = CONN_CLOSED;
+	return;
     }
-    *s++ = 0;
-    return sbuf;
+#endif
+    free(req);
 }
 
 
@@ -209,291 +730,2533 @@ static int base64decode( char *out, int outLen, char *in)
 }
 
 //
-// The main request loop, one per connection.
-// This is wrapped in cleanup code by request().
-//
-static void *request_loop( HTTPD_Request req)
-{
-    char line[10240];
-    char url[8192];
-    char method[32], protocol[32];
-
-    if ( !start_watchdog(req)) return NULL;
-
-    do {
-	//
-	// Reset in case we are on a keep alive connection
-	//
-	req->sentStatus = 0;
-
-	//
-	// Clear our authorization string
-	//
-	req->authorization[0] = 0;
-
-	//
-	// Get the Request
-	//
-	if ( !sgets(line,sizeof(line)-1, req->socket)) {
-	    log_f("Failed to read request line: %s\n", strerror(errno));
-	    return NULL;
-	}
-	if ( sscanf( line, "%31s %8191s %31s\n", method, url, protocol) < 2) {
-	    log_f("Illegal request: %s\n", line);
-	    return NULL;
-	}
-	if ( strcmp(protocol,"HTTP/1.1")==0) req->protocol = 0x11;
-	else req->protocol = 0x10;
-    
-	//
-	// Get the headers
-	//
-	for (;;) {
-	    char buf[1024];
-
-	    if ( !sgets(line,sizeof(line)-1, req->socket)) {
-		log_f("Failed to read request line\n");
-		return NULL;
-	    }
-	    if ( line[0] == '\n' || line[0] == '\r') break;
-
-	    if ( sscanf( line, "Authorization: Basic %1023s", buf) == 1) {
-		base64decode( req->authorization, sizeof( req->authorization), buf);
-		log_f("Authenticate: Basic %s\n", req->authorization);
-	    }
-	    //log_f("Header: %s", line);
-	}
-    
-	(req->func)(req, method, url);
-    
-	if ( 1) {
-	    if ( setsockopt(req->socket, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero))) {
-		log_f("Failed to un-TCP_CORK for HTTPD: %s\n", strerror(errno));
-	    }
-	    if ( setsockopt(req->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
-		log_f("Failed to TCP_NODELAY for HTTPD: %s\n", strerror(errno));
-	    }
-	    if ( setsockopt(req->socket, IPPROTO_TCP, TCP_CORK, &one, sizeof(one))) {
-		log_f("Failed to TCP_CORK for HTTPD: %s\n", strerror(errno));
-	    }
-	}
-
-	set_deadline( req, MAX_HTTPD_TIMEOUT);
-    } while ( req->protocol == 0x11 && !noKeepAlive);
-
-    log_f("Ending request thread.\n");
-
-    return NULL;
-}
-
-//
-// There is one of these threads for each http connection.
-// It reads the request dispatches it, and cleans up afterward.
+// Look up a header by name from the request we are handling.
 //
-static void *request( HTTPD_Request req)
+static const char *find_header( HTTPD_Request req, const char *name)
 {
-    void *res;
-
-    pthread_detach( pthread_self());
-
-    pthread_cleanup_push( cleanup_request, (void *)req);
-    res = request_loop(req);
-    pthread_cleanup_pop( 1);
-    
-    free(req);
+    int i;
 
+    for ( i = 0; i < req->nHeaders; i++) {
+	if ( strcasecmp( req->headers[i].name, name) == 0) return req->headers[i].value;
+    }
     return NULL;
 }
 
 //
-// There is one of these threads per daemon. It listens to the port, accepts connections,
-// and starts 'request' threads to handle them.
-//
-// It really should keep track of how many requests are going and not make too many.
+// Split one complete line of the request, already NUL terminated, into
+// the request line or a header. Returns 0 if the line is unintelligible.
 //
-static void *listener( struct httpd *httpd)
+static int parse_line( HTTPD_Request req, char *line)
 {
-  log_f("Starting listener on %s...\n", httpd->bindName);
-
-    if ( sem_init( &httpd->counter, 0, MAX_HTTPD_CONNECTIONS) == -1) {
-      log_f("Failed to initialize HTTPD semaphore: %s\n", strerror(errno));
-	exit(EXIT_FAILURE);
-    }
+    char *colon;
 
-    httpd->sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (httpd->sock == -1) {
-      log_f("Failed to create socket for HTTPD: %s\n", strerror(errno));
-	exit(EXIT_FAILURE);
-    }
+    if ( !req->method) {
+	char *protocol;
 
-    // This tells us to bind even if there are sockets laying around in the TIME_WAIT state.
-    // It is what lets us stop the server and restart immediately without hanging around 30 seconds.
-    {
-	int on = 1;
-	if (setsockopt(httpd->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
-	  log_f("Failed to set SO_REUSEADDR for HTTPD: %s\n", strerror(errno));
+	req->method = strtok_r( line, " \t", &colon);
+	req->url = strtok_r( NULL, " \t", &colon);
+	protocol = strtok_r( NULL, " \t", &colon);
+	if ( !req->method || !req->url) {
+	    log_f("Illegal request: %s\n", line);
+	    return 0;
 	}
+	if ( protocol && strcmp(protocol,"HTTP/1.1")==0) req->protocol = 0x11;
+	else req->protocol = 0x10;
+	return 1;
     }
 
-    if (bind(httpd->sock, httpd->bindAddr->ai_addr, httpd->bindAddr->ai_addrlen) == -1) {
-      log_f("Failed to bind to %s for HTTPD: %s\n", httpd->bindName, strerror(errno));
-	exit(EXIT_FAILURE);
+    colon = strchr( line, ':');
+    if ( !colon) {
+	log_f("Illegal header: %s\n", line);
+	return 0;
     }
+    *colon++ = 0;
+    while( *colon == ' ' || *colon == '\t') colon++;
 
-    if (listen(httpd->sock,MAX_HTTPD_LISTEN_BACKLOG) == -1) {
-      log_f("Failed to listen to port %s for HTTPD: %s\n", httpd->bindName, strerror(errno));
-	exit(EXIT_FAILURE);
+    if ( req->nHeaders == MAX_HTTPD_HEADERS) {
+	log_f("Too many headers, ignoring %s\n", line);
+	return 1;
     }
+    req->headers[req->nHeaders].name = line;
+    req->headers[req->nHeaders].value = colon;
+    req->nHeaders++;
+    //log_f("Header: %s: %s\n", line, colon);
+    return 1;
+}
 
-    for (;;) {
-	struct sockaddr_in addr = { .sin_family = AF_INET };
-	socklen_t addrlen = sizeof(addr);
-	struct http_request *r;
-	int ns;
-
-	//
-	// Reserve a thread from the counter
-	//
-	do {
-	    int s = sem_wait( &httpd->counter);
-	    if ( s == -1 && errno == EINTR) continue;
-	    if ( s == -1) {
-	      log_f("Failed in HTTPD sem_wait: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
-	    }
-	} while(0);
-
-	do {
-	    ns = accept( httpd->sock, (struct sockaddr *)&addr, &addrlen);
-	    if ( ns == -1 && errno == EINTR) continue;
-	} while(0);
+//
+// Pick up where we left off in the input buffer and consume whole lines.
+// Returns the length of the request including the blank line once it is
+// all here, 0 if we need more, or -1 if it is bad and we have already
+// queued an error response.
+//
+static int parse_request( HTTPD_Request req)
+{
+    while ( req->parsed < req->inUsed) {
+	char *line = req->in + req->parsed;
+	char *nl = memchr( line, '\n', req->inUsed - req->parsed);
 
-	if ( ns == -1) {
-	  log_f("Failed while accepting connections on %s for HTTPD: %s\n", httpd->bindName, strerror(errno));
-	    exit(EXIT_FAILURE);
-	}
+	if ( !nl) break;
 
-	if ( 0) {
-	    int v;
-	    sem_getvalue( &httpd->counter, &v);
-	    log_f("httpd threads left = %d\n", v);
-	}
+	req->parsed = nl - req->in + 1;
+	*nl = 0;
+	if ( nl > line && nl[-1] == '\r') nl[-1] = 0;
 
-	#if 0
-	if (setsockopt(ns, IPPROTO_TCP, TCP_QUICKACK, &zero, sizeof(zero)) < 0) {
-	    log_f("Failed to clear TCP_QUICKACK for HTTPD: %s\n", strerror(errno));
-	}
-	#endif
-	if ( setsockopt(ns, IPPROTO_TCP, TCP_CORK, &one, sizeof(one))) {
-	    log_f("Failed to set TCP_CORK for HTTPD: %s\n", strerror(errno));
+	if ( line[0] == 0) {
+	    if ( !req->method) continue;   // tolerate stray blank lines between requests
+	    return req->parsed;
 	}
-
-	r = calloc( sizeof(*r), 1);
-	memcpy( &r->remote_addr, &addr, sizeof(r->remote_addr));
-	r->httpd = httpd;
-	r->socket = ns;
-	r->func = httpd->func;
-
-	if ( pthread_create( &r->thread, NULL, (Pfunc)request, r) != 0) {
-	  log_f("Failed to create thread for request on HTTPD %s: %s", httpd->bindName, strerror(errno));
-	    close(ns);
-	    free(r);
+	if ( !parse_line( req, line)) {
+	    req->protocol = 0x10;
+	    HTTPD_Send_Status( req, 400, "Bad Request");
+	    HTTPD_Send_Body( req, "400 - Bad request", 17);
+	    return -1;
 	}
     }
 
+    if ( req->inUsed >= MAX_HTTPD_HEADER_SIZE) {
+	log_f("Request headers too large\n");
+	req->protocol = 0x10;
+	HTTPD_Send_Status( req, 431, "Request Header Fields Too Large");
+	HTTPD_Send_Body( req, "431 - Request header fields too large", 37);
+	return -1;
+    }
     return 0;
 }
 
-pthread_t HTTPD_Start( const char *bindPort, void (*func)(HTTPD_Request req, const char *method, const char *url) )
+//
+// Send one piece of a body started by HTTPD_Send_Body_Chunk(). Over HTTP/1.0
+// there are no chunks, the bytes just go and the close marks the end.
+//
+static void send_chunk( HTTPD_Request req, const void *data, unsigned int length)
 {
-    char node[256]="",serv[256]="";
-    struct httpd *h = calloc(sizeof(struct httpd),1);
-    h->func = func;
-    h->bindName = bindPort;
-    
-    if ( strchr( bindPort, ':')) sscanf( bindPort, "%255[^:]:%255s",node,serv); 
-    else sscanf( bindPort, "%255s", serv);
+    char size[16];
+    struct iovec iov[3] = {
+	{ .iov_base = size, .iov_len = 0 },
+	{ .iov_base = (void *)data, .iov_len = length },
+	{ .iov_base = "\r\n", .iov_len = 2 },
+    };
 
-    {
-	int r;
-	struct addrinfo hints = { .ai_family = AF_INET,
-				  .ai_socktype = SOCK_STREAM,
-				  .ai_flags = AI_PASSIVE, };
-	if ( (r = getaddrinfo( node[0]?node:NULL, serv, &hints, &h->bindAddr)) ) {
-	  log_f("HTTPD_Start getaddrinfo failed (%s:%s): %s\n", node,serv,gai_strerror(r));
-	    exit(1);
-	}
+    if ( length == 0) return;   // an empty chunk would end the body
+    if ( req->chunked < 0) {
+	Send_Vector( req, iov+1, 1);
+	return;
     }
+    iov[0].iov_len = snprintf( size, sizeof(size), "%x\r\n", length);
+    Send_Vector( req, iov, 3);
+}
 
-    if ( pthread_create( &h->thread, NULL, (Pfunc)listener, h)) {
-      log_f("Failed to start HTTPD thread: %s", strerror(errno));
-	exit(1);
-    }
-    return h->thread;
+static void flush_chunks( HTTPD_Request req)
+{
+    send_chunk( req, req->chunkBuf, req->chunkUsed);
+    req->chunkUsed = 0;
 }
 
-static int Send_Buffer( HTTPD_Request req, const void *buf, int len)
+//
+// The handler is done with this response. Finish off a chunked body with
+// whatever was gathered and the last, empty chunk, then send anything left.
+//
+static void finish_response( HTTPD_Request req)
 {
-    int togo = len;
-    const void *b = buf;
+    if ( req->chunked) {
+	flush_chunks( req);
+	if ( req->chunked > 0) {
+	    struct iovec iov = { .iov_base = "0\r\n\r\n", .iov_len = 5 };
 
-    while( togo > 0) {
-	int c = send( req->socket, b, togo, MSG_NOSIGNAL);
-	if ( c == -1 && errno == EINTR) continue;
-	if ( c == -1) {
-	  log_f("Error sending on HTTPD: %s\n", strerror(errno));
-	    return 0;
+	    Send_Vector( req, &iov, 1);
 	}
-	togo -= c;
-	b += c;
+	req->chunked = 0;
     }
-    return 1;
+    Send_Vector( req, 0, 0);   // a handler which never sent a body
 }
 
-void HTTPD_Send_Status(HTTPD_Request req, int status, const char *text)
+//
+// Hand a completely parsed request to the handler.
+//
+static void handle_request( HTTPD_Request req)
 {
-    char buf[1024];
+    const char *h;
 
-    if ( req->sentStatus) return;
-    if ( req->protocol >= 0x11 ) {
-	if ( noKeepAlive) {
-	    snprintf( buf, sizeof(buf)-1, "HTTP/1.1 %3d %s\r\nConnection: close\r\n", status, text);
-	} else {
-	    snprintf( buf, sizeof(buf)-1, "HTTP/1.1 %3d %s\r\n", status, text);
+    //
+    // Pull out our authorization string. Decoded it is shorter, so it goes
+    // over the header itself rather than into a buffer of its own.
+    //
+    req->authorization = 0;
+    h = find_header( req, "Authorization");
+    if ( h && strncasecmp( h, "Basic ", 6) == 0) {
+	char buf[1024];
+
+	if ( sscanf( h+6, " %1023s", buf) == 1) {
+	    base64decode( (char *)h, strlen(h) + 1, buf);
+	    if ( h[0]) req->authorization = h;
+	    log_f("Authenticate: Basic %s\n", h);
 	}
-    } else {
-	snprintf( buf, sizeof(buf)-1, "HTTP/1.0 %3d \r\n", status);
     }
 
+    req->keepAlive = ( req->protocol == 0x11 && !noKeepAlive);
+    h = find_header( req, "Connection");
+    if ( h && strcasecmp( h, "close") == 0) req->keepAlive = 0;
 
-    Send_Buffer( req, buf, strlen(buf));
-    req->sentStatus = 1;
+    (req->func)(req, req->method, req->url);
+    if ( !req->waitFunc) finish_response( req);
 }
 
-void HTTPD_Add_Header(HTTPD_Request req, const char *h)
+//
+// The input buffer is allocated when there is something to read into it,
+// and freed whenever it empties. Returns 0 if we can't have one.
+//
+static int input_buffer( HTTPD_Request req)
 {
-  if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
-
-    Send_Buffer(req, h, strlen(h));
-    Send_Buffer(req, "\r\n", 2);
+    if ( req->in) return 1;
+    req->in = malloc( MAX_HTTPD_HEADER_SIZE);
+    if ( req->in) return 1;
+    log_f("Failed to allocate HTTPD input buffer\n");
+    return 0;
 }
 
-void HTTPD_Send_Body(HTTPD_Request req, const void *data, int length)
+//
+// Drop the first 'used' bytes of the input buffer.
+//
+static void consume_input( HTTPD_Request req, unsigned int used)
 {
-    char buf[1024];
-    
-    if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
+    req->inUsed -= used;
+    if ( req->inUsed) {
+	memmove( req->in, req->in + used, req->inUsed);
+	return;
+    }
+    free( req->in);
+    req->in = 0;
+}
+
+//
+// Forget the request we just handled and slide anything which followed
+// it to the front of the buffer.
+//
+static void consume_request( HTTPD_Request req, unsigned int length)
+{
+    consume_input( req, length);
+    req->parsed = 0;
+    req->authorization = 0;
+    req->sentStatus = 0;
+    req->headUsed = 0;
+    req->method = 0;
+    req->url = 0;
+    req->nHeaders = 0;
+}
+
+//
+// Once a response is completely on its way, push out the last partial
+// packet rather than waiting for the cork to time out.
+//
+static void push_output( HTTPD_Request req)
+{
+    if ( req->parent) req = req->parent;   // FastCGI, it is the web server's connection
+    if ( !req->httpd->tcp) return;   // a unix socket sends what it has straight away
+    if ( setsockopt(req->socket, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero))) {
+	log_f("Failed to un-TCP_CORK for HTTPD: %s\n", strerror(errno));
+    }
+    if ( setsockopt(req->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+	log_f("Failed to TCP_NODELAY for HTTPD: %s\n", strerror(errno));
+    }
+    if ( setsockopt(req->socket, IPPROTO_TCP, TCP_CORK, &one, sizeof(one))) {
+	log_f("Failed to TCP_CORK for HTTPD: %s\n", strerror(errno));
+    }
+}
+
+//
+// After a response is completely on its way, either go back for the next
+// request on a keep alive connection or finish up.
+//
+static void response_done( HTTPD_Request req)
+{
+    if ( req->state == CONN_CLOSING) return;
+
+    if ( !req->held) push_output(req);   // only once the pipeline drains
+
+    if ( req->keepAlive) {
+	req->state = CONN_READING;
+	set_deadline( req, req->inUsed ? MAX_HTTPD_HEADER_TIMEOUT : MAX_HTTPD_IDLE_TIMEOUT);
+	watch_request( req, EPOLLIN | EPOLLRDHUP);
+    } else {
+	req->state = CONN_CLOSING;
+    }
+}
+
+//
+// Wait for the socket to drain if we have output queued, otherwise for the
+// next frame. Either way, notice if the client goes away.
+//
+static void watch_stream( HTTPD_Request req)
+{
+    unsigned int in = req->messageFunc ? EPOLLIN : 0;   // a WebSocket talks back
+
+    if ( req->out) {
+	set_deadline( req, MAX_HTTPD_WRITE_TIMEOUT);
+	watch_request( req, EPOLLOUT | EPOLLRDHUP | in);
+    } else if ( req->streamEnded) {
+	req->state = CONN_CLOSING;   // all of it has gone, hang up
+    } else {
+	push_output(req);
+	set_deadline( req, MAX_HTTPD_STREAM_IDLE);
+	watch_request( req, EPOLLRDHUP | in);
+    }
+}
+
+//
+// Send a stream the current frame, and note when.
+//
+static void push_frame( HTTPD_Request req)
+{
+    req->lastFrame = now_ms();
+    (req->streamFunc)(req);
+}
+
+static void start_stream( HTTPD_Request req)
+{
+    req->state = CONN_STREAMING;
+    link_stream(req);
+    watch_stream(req);
+}
+
+//
+// The handler has finished with a request, send the connection on to
+// whatever comes next.
+//
+static void request_done( HTTPD_Request req)
+{
+    if ( req->state != CONN_READING) return;  // the handler failed a send
+    if ( req->streamFunc) {
+	start_stream(req);
+	return;
+    }
+    if ( req->held && !(req->coalesce && req->keepAlive)) Send_Vector( req, 0, 0);
+    if ( req->out && !req->held) {
+	req->state = CONN_WRITING;
+	set_deadline( req, MAX_HTTPD_WRITE_TIMEOUT);
+	watch_request( req, EPOLLOUT);
+	return;
+    }
+    response_done(req);
+}
+
+//
+// FastCGI. The web server keeps a few connections open to us and sends
+// each request as a BEGIN_REQUEST, its PARAMS, which carry the method, URL
+// and headers, and its STDIN, which we have no use for. Requests can be
+// interleaved, so each becomes a child of the connection, runs through the
+// same handler as an HTTP request once its STDIN ends, and sends its
+// response back as STDOUT records. The handlers run on the listener, never
+// the workers, and the children can wait for a frame but not stream.
+//
+static void fastcgi_header( unsigned char *h, int type, unsigned int id, unsigned int length)
+{
+    h[0] = 1;   // version
+    h[1] = type;
+    h[2] = id >> 8;
+    h[3] = id;
+    h[4] = length >> 8;
+    h[5] = length;
+    h[6] = 0;   // no padding
+    h[7] = 0;
+}
+
+//
+// Finish a request with the end of its output and an END_REQUEST.
+//
+static void fastcgi_end_request( HTTPD_Request req, unsigned int id, int status)
+{
+    unsigned char r[24];
+    struct iovec iov = { .iov_base = r, .iov_len = sizeof(r) };
+
+    fastcgi_header( r, FCGI_STDOUT, id, 0);
+    fastcgi_header( r+8, FCGI_END_REQUEST, id, 8);
+    memset( r+16, 0, 8);   // application status 0
+    r[20] = status;
+    Send_Vector( req, &iov, 1);
+}
+
+static void fastcgi_end( HTTPD_Request req)
+{
+    fastcgi_end_request( req->parent, req->requestId, FCGI_REQUEST_COMPLETE);
+    req->state = CONN_CLOSING;
+}
+
+//
+// Send a child's status, headers and pieces to the web server, in as few
+// STDOUT records as will hold them.
+//
+static int fastcgi_send( HTTPD_Request req, const struct iovec *pieces, int count)
+{
+    struct iovec all[MAX_HTTPD_CHUNKS+3];
+    size_t skip = 0;
+    int i, n = 0;
+
+    if ( req->state == CONN_CLOSING) return 0;
+
+    if ( req->headUsed) {
+	all[n].iov_base = req->head;
+	all[n].iov_len = req->headUsed;
+	n++;
+	req->headUsed = 0;
+    }
+    if ( count > MAX_HTTPD_CHUNKS+2) {
+	log_f("Too many pieces for HTTPD Send_Vector: %d\n", count);
+	req->state = CONN_CLOSING;
+	return 0;
+    }
+    for ( i = 0; i < count; i++) {
+	if ( pieces[i].iov_len) all[n++] = pieces[i];   // an empty record would end the output
+    }
+
+    for ( i = 0; i < n; ) {
+	unsigned char h[8];
+	struct iovec rec[MAX_HTTPD_CHUNKS+2];
+	unsigned int length = 0;
+	int r = 1;
+
+	while ( i < n && r < MAX_HTTPD_CHUNKS+2 && length < 65535) {
+	    size_t take = all[i].iov_len - skip;
+
+	    if ( take > 65535 - length) take = 65535 - length;
+	    rec[r].iov_base = (char *)all[i].iov_base + skip;
+	    rec[r].iov_len = take;
+	    r++;
+	    length += take;
+	    skip += take;
+	    if ( skip == all[i].iov_len) {
+		i++;
+		skip = 0;
+	    }
+	}
+	fastcgi_header( h, FCGI_STDOUT, req->requestId, length);
+	rec[0].iov_base = h;
+	rec[0].iov_len = sizeof(h);
+	if ( !Send_Vector( req->parent, rec, r)) {
+	    req->state = CONN_CLOSING;
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+//
+// Take the next name-value pair from a PARAMS or GET_VALUES body. Each
+// length is one byte, or four with the top bit set. Returns 0 at the end,
+// or if the pair runs off it.
+//
+static int fastcgi_pair( unsigned char **p, unsigned char *end, unsigned char **name, unsigned int *nameLen,
+			 unsigned char **value, unsigned int *valueLen)
+{
+    unsigned int len[2];
+    int i;
+
+    for ( i = 0; i < 2; i++) {
+	unsigned char *q = *p;
+
+	if ( q >= end) return 0;
+	if ( q[0] & 0x80) {
+	    if ( end - q < 4) return 0;
+	    len[i] = (unsigned int)(q[0] & 0x7f) << 24 | q[1] << 16 | q[2] << 8 | q[3];
+	    *p += 4;
+	} else {
+	    len[i] = q[0];
+	    *p += 1;
+	}
+    }
+    if ( len[0] > (size_t)(end - *p) || len[1] > (size_t)(end - *p) - len[0]) return 0;
+
+    *name = *p;
+    *nameLen = len[0];
+    *value = *p + len[0];
+    *valueLen = len[1];
+    *p += len[0] + len[1];
+    return 1;
+}
+
+//
+// All of a child's params are in 'in'. Rewrite them in place as NUL terminated
+// names and values, which fits because every pair loses at least two bytes of
+// lengths, and pick out the method, the URL and the HTTP_ headers, which get
+// their names back, near enough, for HTTPD_Get_Header().
+//
+static void fastcgi_params( HTTPD_Request req)
+{
+    unsigned char *p = (unsigned char *)req->in, *end = p + req->inUsed;
+    char *out = req->in;
+    unsigned char *name, *value;
+    unsigned int nameLen, valueLen;
+
+    while ( fastcgi_pair( &p, end, &name, &nameLen, &value, &valueLen)) {
+	char *n = out, *v = out + nameLen + 1;
+
+	memmove( n, name, nameLen);
+	n[nameLen] = 0;
+	memmove( v, value, valueLen);
+	v[valueLen] = 0;
+	out = v + valueLen + 1;
+
+	if ( strcmp( n, "REQUEST_METHOD") == 0) req->method = v;
+	else if ( strcmp( n, "REQUEST_URI") == 0) req->url = v;
+	else if ( strncmp( n, "HTTP_", 5) == 0 && req->nHeaders < MAX_HTTPD_HEADERS) {
+	    char *c;
+
+	    for ( c = n+5; *c; c++) if ( *c == '_') *c = '-';
+	    req->headers[req->nHeaders].name = n+5;
+	    req->headers[req->nHeaders].value = v;
+	    req->nHeaders++;
+	}
+    }
+}
+
+//
+// The child's STDIN has ended, so the whole request is here. Answer it, or
+// park it if the handler wants to wait for a frame.
+//
+static void fastcgi_run( HTTPD_Request req)
+{
+    req->state = CONN_HANDLING;
+    if ( req->tooBig || !req->method || !req->url) {
+	HTTPD_Send_Status( req, 400, "Bad Request");
+	HTTPD_Send_Body( req, "400 - Bad request", 17);
+    } else {
+	handle_request( req);
+	if ( req->waitFunc && req->state != CONN_CLOSING) {
+	    req->state = CONN_WAITING;
+	    link_stream(req);
+	    set_wait_deadline( req);
+	    return;
+	}
+    }
+    fastcgi_end( req);
+    cleanup_request( req);
+}
+
+static HTTPD_Request fastcgi_child( HTTPD_Request req, unsigned int id)
+{
+    struct http_request *c;
+
+    for ( c = req->children; c; c = c->childNext) {
+	if ( c->requestId == id) return c;
+    }
+    return 0;
+}
+
+static void fastcgi_begin( HTTPD_Request req, unsigned int id, const unsigned char *body)
+{
+    struct http_request *c;
+    int count = 0;
+
+    if ( (body[0] << 8 | body[1]) != FCGI_RESPONDER) {
+	fastcgi_end_request( req, id, FCGI_UNKNOWN_ROLE);
+	return;
+    }
+    for ( c = req->children; c; c = c->childNext) count++;
+    if ( count >= MAX_HTTPD_FASTCGI_REQUESTS || !(c = calloc( sizeof(*c), 1))) {
+	log_f("Too many FastCGI requests on one connection, refusing one.\n");
+	fastcgi_end_request( req, id, FCGI_OVERLOADED);
+	return;
+    }
+    memcpy( &c->remote_addr, &req->remote_addr, sizeof(c->remote_addr));
+    c->httpd = req->httpd;
+    c->socket = -1;
+    c->func = req->func;
+    c->state = CONN_READING;
+    c->outTail = &c->out;
+    c->protocol = 0x10;   // so a body of unknown length just goes until the END_REQUEST
+    c->parent = req;
+    c->requestId = id;
+    c->keepConn = body[2] & FCGI_KEEP_CONN;
+    c->childNext = req->children;
+    req->children = c;
+}
+
+//
+// Tell the web server what we can do. Only what it asked about is answered.
+//
+static void fastcgi_values( HTTPD_Request req, unsigned char *body, unsigned int length)
+{
+    unsigned char r[128];
+    struct iovec iov = { .iov_base = r };
+    unsigned char *p = body, *name, *value;
+    unsigned int nameLen, valueLen, used = 8;
+
+    while ( fastcgi_pair( &p, body + length, &name, &nameLen, &value, &valueLen)) {
+	char v[16];
+
+	if ( nameLen == 14 && memcmp( name, "FCGI_MAX_CONNS", 14) == 0) snprintf( v, sizeof(v), "%d", maxConnections);
+	else if ( nameLen == 13 && memcmp( name, "FCGI_MAX_REQS", 13) == 0) snprintf( v, sizeof(v), "%d", MAX_HTTPD_FASTCGI_REQUESTS);
+	else if ( nameLen == 15 && memcmp( name, "FCGI_MPXS_CONNS", 15) == 0) strcpy( v, "1");
+	else continue;
+
+	valueLen = strlen(v);
+	if ( used + 2 + nameLen + valueLen > sizeof(r)) break;
+	r[used++] = nameLen;
+	r[used++] = valueLen;
+	memcpy( r + used, name, nameLen);
+	used += nameLen;
+	memcpy( r + used, v, valueLen);
+	used += valueLen;
+    }
+    fastcgi_header( r, FCGI_GET_VALUES_RESULT, 0, used - 8);
+    iov.iov_len = used;
+    Send_Vector( req, &iov, 1);
+}
+
+//
+// A record small enough to have arrived whole.
+//
+static void fastcgi_record( HTTPD_Request req, int type, unsigned int id, unsigned char *body, unsigned int length)
+{
+    struct http_request *c;
+
+    switch( type) {
+      case FCGI_BEGIN_REQUEST:
+	if ( id != 0 && length >= 8 && !fastcgi_child( req, id)) fastcgi_begin( req, id, body);
+	break;
+      case FCGI_ABORT_REQUEST:
+	if ( (c = fastcgi_child( req, id))) {
+	    fastcgi_end( c);
+	    cleanup_request( c);
+	}
+	break;
+      case FCGI_GET_VALUES:
+	fastcgi_values( req, body, length);
+	break;
+      default:
+	if ( id == 0) {   // a management record we don't know
+	    unsigned char r[16];
+	    struct iovec iov = { .iov_base = r, .iov_len = sizeof(r) };
+
+	    fastcgi_header( r, FCGI_UNKNOWN_TYPE, 0, 8);
+	    memset( r+8, 0, 8);
+	    r[8] = type;
+	    Send_Vector( req, &iov, 1);
+	}
+	break;
+    }
+}
+
+//
+// Some of a PARAMS or STDIN record, or with no length its empty record, which
+// ends the stream.
+//
+static void fastcgi_content( HTTPD_Request req, const unsigned char *data, unsigned int length)
+{
+    struct http_request *c = fastcgi_child( req, req->recId);
+
+    if ( !c || c->state != CONN_READING) return;
+
+    if ( req->recType == FCGI_PARAMS) {
+	if ( length == 0) fastcgi_params( c);
+	else if ( c->inUsed + length > MAX_HTTPD_HEADER_SIZE || !input_buffer( c)) c->tooBig = 1;
+	else {
+	    memcpy( c->in + c->inUsed, data, length);
+	    c->inUsed += length;
+	}
+    } else if ( req->recType == FCGI_STDIN && length == 0) {
+	fastcgi_run( c);
+    }
+}
+
+//
+// Take apart the records in a parent's input buffer. PARAMS and STDIN may be
+// any length, so they are passed along as they come, but any other record
+// must fit in the buffer whole.
+//
+static void fastcgi_input( HTTPD_Request req)
+{
+    unsigned int used = 0;
+
+    while ( req->state == CONN_READING) {
+	unsigned char *p = (unsigned char *)req->in + used;
+	unsigned int avail = req->inUsed - used;
+	unsigned int length, pad;
+
+	if ( req->recLeft || req->recPad) {
+	    unsigned int n = req->recLeft ? req->recLeft : req->recPad;
+
+	    if ( n > avail) n = avail;
+	    if ( n == 0) break;
+	    if ( req->recLeft) {
+		fastcgi_content( req, p, n);
+		req->recLeft -= n;
+	    } else {
+		req->recPad -= n;
+	    }
+	    used += n;
+	    continue;
+	}
+
+	if ( avail < 8) break;
+	if ( p[0] != 1) {
+	    log_f("Unknown FastCGI version %d\n", p[0]);
+	    req->state = CONN_CLOSING;
+	    break;
+	}
+	length = p[4] << 8 | p[5];
+	pad = p[6];
+
+	if ( p[1] == FCGI_PARAMS || p[1] == FCGI_STDIN || p[1] == FCGI_DATA) {
+	    req->recType = p[1];
+	    req->recId = p[2] << 8 | p[3];
+	    req->recLeft = length;
+	    req->recPad = pad;
+	    used += 8;
+	    if ( length == 0) fastcgi_content( req, 0, 0);
+	    continue;
+	}
+
+	if ( 8 + length + pad > MAX_HTTPD_HEADER_SIZE) {
+	    log_f("FastCGI record too large\n");
+	    req->state = CONN_CLOSING;
+	    break;
+	}
+	if ( avail < 8 + length + pad) break;
+	fastcgi_record( req, p[1], p[2] << 8 | p[3], p + 8, length);
+	used += 8 + length + pad;
+    }
+
+    consume_input( req, used);
+    if ( req->eof) req->state = CONN_CLOSING;
+}
+
+//
+// Watch a parent for input, or for room to send if it has output queued, in
+// which case the web server will wait for its answers before asking for
+// more. Once the last child has gone from a connection the web server didn't
+// want kept, we shut our side and close when it does.
+//
+static void fastcgi_watch( HTTPD_Request req)
+{
+    if ( req->out) {
+	set_deadline( req, MAX_HTTPD_WRITE_TIMEOUT);
+	watch_request( req, EPOLLOUT | EPOLLRDHUP);
+	return;
+    }
+    push_output(req);
+    if ( !req->keepAlive && !req->children) shutdown( req->socket, SHUT_WR);
+    set_deadline( req, MAX_HTTPD_FASTCGI_IDLE);
+    watch_request( req, EPOLLIN | EPOLLRDHUP);
+}
+
+//
+// A wait times out to the ms. The wheel only goes by seconds, so it just
+// has a backstop a second after, and the listener wakes itself for the
+// earliest wait due and answers it from expire_waits().
+//
+static void set_wait_deadline( HTTPD_Request req)
+{
+    struct httpd *httpd = req->httpd;
+
+    req->waitUntil = now_ms() + req->waitMs;
+    set_deadline( req, (req->waitMs + 999) / 1000 + 1);
+    if ( httpd->waitDue && httpd->waitDue <= req->waitUntil) return;
+
+    httpd->waitDue = req->waitUntil;
+#ifdef HTTPD_IO_URING
+    if ( httpd->ring.fd >= 0) ring_wait_timer( httpd);
+#endif
+}
+
+//
+// Park a request whose handler called HTTPD_Wait(). The request stays in
+// the front of the input buffer so its url and headers remain good, and
+// anything pipelined behind it waits its turn.
+//
+static void start_wait( HTTPD_Request req)
+{
+    req->coalesce = 0;
+    if ( req->held) Send_Vector( req, 0, 0);   // what came before doesn't wait with us
+    req->state = CONN_WAITING;
+    link_stream(req);
+    set_wait_deadline( req);
+    watch_request( req, EPOLLRDHUP);
+}
+
+//
+// Offer a new frame, or the news that time is up, to a parked request.
+// Once it answers, carry on as though it had answered right away.
+//
+static void finish_wait( HTTPD_Request req, int expired)
+{
+    if ( !(req->waitFunc)(req, expired) && !expired) return;
+
+    req->waitFunc = 0;
+    unlink_stream(req);
+    finish_response( req);
+    if ( req->parent) {
+	fastcgi_end( req);
+	return;
+    }
+    if ( req->state == CONN_CLOSING) return;
+
+    consume_request( req, req->pendingLength);
+    req->state = CONN_READING;
+    request_done(req);
+    if ( req->state == CONN_READING) process_input(req);
+}
+
+//
+// The handler has returned, park the request if it asked to wait or else
+// move on past it.
+//
+static void request_handled( HTTPD_Request req)
+{
+    if ( req->waitFunc && req->state == CONN_READING) {
+	start_wait( req);
+	return;
+    }
+    consume_request( req, req->pendingLength);
+    request_done(req);
+}
+
+//
+// Give a request to the workers. Until one hands it back it is off the
+// wheel and epoll will report at most one event for it, which we ignore.
+//
+static void queue_request( HTTPD_Request req)
+{
+    req->state = CONN_HANDLING;
+    cancel_deadline(req);
+    watch_request( req, EPOLLONESHOT);
+    req->working = 1;
+
+    req->workNext = 0;
+    pthread_mutex_lock( &workMutex);
+    *workTail = req;
+    workTail = &req->workNext;
+    pthread_cond_signal( &workCond);
+    pthread_mutex_unlock( &workMutex);
+}
+
+//
+// Is there another whole request in the buffer after this one? Then its
+// response can go out with this one's.
+//
+static int more_requests( HTTPD_Request req, unsigned int length)
+{
+    const char *p = req->in + length;
+    unsigned int left = req->inUsed - length;
+
+    while ( left && (*p == '\r' || *p == '\n')) {   // stray blank lines
+	p++;
+	left--;
+    }
+    return memmem( p, left, "\n\r\n", 3) || memmem( p, left, "\n\n", 2);
+}
+
+//
+// Handle every complete request in the input buffer, in order. Their
+// responses are coalesced, and the cork is only pulled once the last is
+// answered. A request that leaves output queued stops the loop until the
+// socket drains.
+//
+static void process_input( HTTPD_Request req)
+{
+    if ( req->fastcgi) {
+	fastcgi_input( req);
+	return;
+    }
+    while ( req->state == CONN_READING) {
+	int length;
+
+	req->coalesce = 0;
+	length = parse_request( req);
+	if ( length == 0) {
+	    if ( req->held) {   // more_requests() was fooled, send what we held for it
+		request_done(req);
+		continue;
+	    }
+	    if ( req->eof) req->state = CONN_CLOSING;
+	    return;
+	}
+	if ( length > 0) {
+	    req->pendingLength = length;
+	    req->coalesce = more_requests( req, length);
+	    if ( workerCount) {
+		queue_request( req);
+		return;
+	    }
+	    handle_request( req);
+	    request_handled( req);
+	} else {
+	    req->keepAlive = 0;
+	    request_done(req);
+	}
+    }
+}
+
+//
+// Pick up the requests the workers have finished and carry on with them
+// as if they had been handled right here.
+//
+static void resume_requests( struct httpd *httpd)
+{
+    struct http_request *r, *next;
+    uint64_t count;
+
+    if ( read( httpd->resume, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+	log_f("Failed to read HTTPD resume event: %s\n", strerror(errno));
+    }
+
+    pthread_mutex_lock( &httpd->resumeMutex);
+    r = httpd->resumed;
+    httpd->resumed = 0;
+    pthread_mutex_unlock( &httpd->resumeMutex);
+
+    for ( ; r; r = next) {
+	next = r->workNext;
+	r->working = 0;
+	if ( r->failed) r->state = CONN_CLOSING;
+	else if ( r->state == CONN_HANDLING) r->state = CONN_READING;
+	request_handled(r);
+	if ( r->state == CONN_READING) process_input(r);
+	if ( r->state == CONN_CLOSING) cleanup_request(r);
+    }
+}
+
+//
+// A worker thread, running handlers for requests from every listener.
+//
+static void *worker( void *unused)
+{
+    uint64_t poke = 1;
+
+    for (;;) {
+	struct http_request *req;
+	struct httpd *httpd;
+
+	pthread_mutex_lock( &workMutex);
+	while ( !workHead) pthread_cond_wait( &workCond, &workMutex);
+	req = workHead;
+	workHead = req->workNext;
+	if ( !workHead) workTail = &workHead;
+	pthread_mutex_unlock( &workMutex);
+
+	handle_request( req);
+
+	httpd = req->httpd;
+	pthread_mutex_lock( &httpd->resumeMutex);
+	req->workNext = httpd->resumed;
+	httpd->resumed = req;
+	pthread_mutex_unlock( &httpd->resumeMutex);
+
+	if ( write( httpd->resume, &poke, sizeof(poke)) == -1 && errno != EAGAIN) {
+	    log_f("Failed to resume HTTPD listener: %s\n", strerror(errno));
+	}
+    }
+    return 0;
+}
+
+static void read_request( HTTPD_Request req)
+{
+    if ( !input_buffer( req)) {
+	req->state = CONN_CLOSING;
+	return;
+    }
+    for (;;) {
+	int e = recv( req->socket, req->in + req->inUsed, MAX_HTTPD_HEADER_SIZE - req->inUsed, 0);
+
+	if ( e == -1 && errno == EINTR) continue;
+	if ( e == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+	if ( e == -1) {
+	    log_f("Failed to read request: %s\n", strerror(errno));
+	    req->state = CONN_CLOSING;
+	    return;
+	}
+	if ( e == 0) {
+	    req->eof = 1;   // a normal end to a keep alive, but finish what we have
+	    break;
+	}
+	if ( req->inUsed == 0) set_deadline( req, MAX_HTTPD_HEADER_TIMEOUT);   // the idle wait is over, the request clock starts
+	req->inUsed += e;
+	break;   // either we drained the socket or filled the buffer, epoll will tell us if there is more
+    }
+    process_input(req);
+}
+
+//
+// Push as much of the queued output as the socket will take.
+// Returns 1 when the queue is empty.
+//
+static int flush_output( HTTPD_Request req)
+{
+    while( req->out) {
+	struct out_buf *o = req->out;
+	int c;
+
+	if ( o->fd >= 0) {
+	    off_t off = o->offset;
+	    c = sendfile( req->socket, o->fd, &off, o->length - o->offset);
+	} else {
+	    c = send( req->socket, o->data + o->offset, o->length - o->offset, MSG_NOSIGNAL);
+	}
+
+	if ( c == -1 && errno == EINTR) continue;
+	if ( c == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+	if ( c == -1) {
+	    log_f("Error sending on HTTPD: %s\n", strerror(errno));
+	    req->state = CONN_CLOSING;
+	    return 0;
+	}
+	o->offset += c;
+	if ( o->offset < o->length) return 0;
+
+	req->out = o->next;
+	if ( !req->out) req->outTail = &req->out;
+	free_out(o);
+    }
+    return 1;
+}
+
+static void write_response( HTTPD_Request req)
+{
+    if ( !flush_output(req)) {
+	set_deadline( req, MAX_HTTPD_WRITE_TIMEOUT);
+	return;
+    }
+    response_done(req);
+    if ( req->state == CONN_READING) process_input(req);
+}
+
+//
+// Once a stream has drained, send it the newest frame if one came while it
+// was busy. It doesn't wait for the next.
+//
+static void write_stream( HTTPD_Request req)
+{
+    if ( !flush_output(req)) {
+	set_deadline( req, MAX_HTTPD_WRITE_TIMEOUT);
+	return;
+    }
+    if ( req->framePending && !req->streamEnded) {
+	req->framePending = 0;
+	push_frame(req);
+	if ( req->state == CONN_CLOSING) return;
+    }
+    watch_stream(req);
+}
+
+//
+// Put a WebSocket frame header for a message of this length into buf, which
+// needs 10 bytes. Ours are never masked or fragmented. Returns the size.
+//
+static int websocket_header( unsigned char *buf, int opcode, uint64_t length)
+{
+    int i;
+
+    buf[0] = 0x80 | opcode;
+    if ( length < 126) {
+	buf[1] = length;
+	return 2;
+    }
+    if ( length < 65536) {
+	buf[1] = 126;
+	buf[2] = length >> 8;
+	buf[3] = length;
+	return 4;
+    }
+    buf[1] = 127;
+    for ( i = 0; i < 8; i++) buf[2+i] = length >> (56 - 8*i);
+    return 10;
+}
+
+//
+// Deal with one complete message from the client. Pings are answered and
+// a close is echoed before we hang up. Data goes to the handler's function.
+//
+static void websocket_message( HTTPD_Request req, int opcode, const char *data, int length)
+{
+    unsigned char h[10];
+    struct iovec iov[2] = { { .iov_base = h },
+			    { .iov_base = (void *)data, .iov_len = length } };
+
+    switch( opcode) {
+      case 0x1:   // text
+      case 0x2:   // binary
+	(req->messageFunc)(req, data, length);
+	break;
+      case 0x8:   // close
+	iov[0].iov_len = websocket_header( h, 0x8, length);
+	Send_Vector( req, iov, 2);
+	req->state = CONN_CLOSING;
+	break;
+      case 0x9:   // ping
+	iov[0].iov_len = websocket_header( h, 0xa, length);
+	Send_Vector( req, iov, 2);
+	break;
+      case 0xa:   // pong
+	break;
+      default:
+	log_f("Ignoring WebSocket opcode %d\n", opcode);
+	break;
+    }
+}
+
+//
+// Read what the client of a WebSocket has sent and take apart every complete
+// frame. Client frames are always masked. Nobody needs to send us anything
+// big, so a frame must fit in the input buffer, and fragmented messages,
+// which we have no use for, are dropped.
+//
+static void read_messages( HTTPD_Request req)
+{
+    unsigned int used = 0;
+    int e;
+
+    if ( !input_buffer( req)) {
+	req->state = CONN_CLOSING;
+	return;
+    }
+    do {
+	e = recv( req->socket, req->in + req->inUsed, MAX_HTTPD_HEADER_SIZE - req->inUsed, 0);
+    } while ( e == -1 && errno == EINTR);
+    if ( e == 0 || (e == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+	req->state = CONN_CLOSING;
+	return;
+    }
+    if ( e > 0) req->inUsed += e;
+
+    while ( req->state == CONN_STREAMING) {
+	unsigned char *f = (unsigned char *)req->in + used;
+	unsigned int avail = req->inUsed - used;
+	uint64_t length;
+	unsigned int head = 2, i;
+	unsigned char *mask;
+
+	if ( avail < 2) break;
+	length = f[1] & 0x7f;
+	if ( length == 126) head += 2;
+	if ( length == 127) head += 8;
+	head += 4;
+	if ( avail < head) break;
+	if ( !(f[1] & 0x80)) {
+	    log_f("Unmasked WebSocket frame from client\n");
+	    req->state = CONN_CLOSING;
+	    return;
+	}
+	if ( length == 126) length = (f[2] << 8) | f[3];
+	else if ( length == 127) {
+	    for ( length = 0, i = 0; i < 8; i++) length = (length << 8) | f[2+i];
+	}
+	if ( length > MAX_HTTPD_HEADER_SIZE - head) {
+	    log_f("WebSocket message too large\n");
+	    req->state = CONN_CLOSING;
+	    return;
+	}
+	if ( avail < head + length) break;
+
+	mask = f + head - 4;
+	for ( i = 0; i < length; i++) f[head+i] ^= mask[i & 3];
+	if ( (f[0] & 0x80) && (f[0] & 0x0f) != 0) {
+	    websocket_message( req, f[0] & 0x0f, (char *)f + head, length);
+	}
+	used += head + length;
+    }
+
+    consume_input( req, used);
+    if ( req->state == CONN_STREAMING) watch_stream(req);
+}
+
+//
+// A new frame has arrived. Give it to every stream which has finished
+// sending the last one, and to every request waiting for it. A stream that
+// is still sending gets the newest frame when it is done, and any frame
+// which is overtaken while it waits is dropped.
+//
+static void wake_streams( struct httpd *httpd)
+{
+    struct http_request *r, *next;
+    uint64_t count;
+
+    if ( read( httpd->wake, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+	log_f("Failed to read HTTPD wake event: %s\n", strerror(errno));
+    }
+
+    for ( r = httpd->streams; r; r = next) {
+	next = r->streamNext;
+	if ( r->state == CONN_WAITING) {
+	    finish_wait( r, 0);
+	    if ( r->state == CONN_CLOSING) cleanup_request(r);
+	    continue;
+	}
+	if ( r->streamEnded) continue;   // only waiting to drain
+	if ( r->paused || now_ms() - r->lastFrame + r->frameInterval / 8 < r->frameInterval) {
+	    if ( !r->out) set_deadline( r, MAX_HTTPD_STREAM_IDLE);   // still alive, just not interested
+	    continue;
+	}
+	if ( r->out) {
+	    if ( r->framePending) {
+		r->dropped++;
+		__sync_fetch_and_add( &stats.droppedFrames, 1);
+	    }
+	    r->framePending = 1;
+	    continue;
+	}
+
+	push_frame(r);
+	if ( r->state != CONN_CLOSING) watch_stream(r);
+	if ( r->state == CONN_CLOSING) cleanup_request(r);
+    }
+}
+
+//
+// Take on a newly accepted connection, or turn it away if we have too many.
+//
+static void shed_connection( struct httpd *httpd, int ns)
+{
+    //
+    // Don't even read the request. The response is one packet and
+    // the kernel will deliver it after we close.
+    //
+    log_f("Too many HTTPD connections, shedding one.\n");
+    __sync_fetch_and_add( &stats.shedConnections, 1);
+    if ( !httpd->fastcgi && send( ns, busyResponse, sizeof(busyResponse)-1, MSG_DONTWAIT|MSG_NOSIGNAL) == -1) {
+	log_f("Failed to send HTTPD busy response: %s\n", strerror(errno));
+    }
+    shutdown( ns, SHUT_WR);
+    close(ns);
+}
+
+static void add_connection( struct httpd *httpd, int ns, const struct sockaddr_storage *addr)
+{
+    struct http_request *r;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP };
+
+    if ( stats.connections >= maxConnections) {
+	shed_connection( httpd, ns);
+	return;
+    }
+
+    #if 0
+    if (setsockopt(ns, IPPROTO_TCP, TCP_QUICKACK, &zero, sizeof(zero)) < 0) {
+	log_f("Failed to clear TCP_QUICKACK for HTTPD: %s\n", strerror(errno));
+    }
+    #endif
+    if ( httpd->tcp && setsockopt(ns, IPPROTO_TCP, TCP_CORK, &one, sizeof(one))) {
+	log_f("Failed to set TCP_CORK for HTTPD: %s\n", strerror(errno));
+    }
+
+    r = calloc( sizeof(*r), 1);
+    if ( !r) {
+	log_f("Failed to allocate request on HTTPD %s\n", httpd->bindName);
+	close(ns);
+	return;
+    }
+    memcpy( &r->remote_addr, addr, sizeof(r->remote_addr));
+    r->httpd = httpd;
+    r->socket = ns;
+    r->func = httpd->func;
+    r->state = CONN_READING;
+    r->outTail = &r->out;
+    r->fastcgi = httpd->fastcgi;
+    r->keepAlive = httpd->fastcgi;   // until a request comes without KEEP_CONN
+
+#ifdef HTTPD_IO_URING
+    if ( httpd->ring.fd >= 0) {
+	watch_request( r, ev.events);
+    } else
+#endif
+    {
+	r->events = ev.events;
+	ev.data.ptr = r;
+	if ( epoll_ctl( httpd->epoll, EPOLL_CTL_ADD, ns, &ev) == -1) {
+	    log_f("Failed to add request to epoll on HTTPD %s: %s\n", httpd->bindName, strerror(errno));
+	    close(ns);
+	    free(r);
+	    return;
+	}
+    }
+
+    set_deadline( r, httpd->fastcgi ? MAX_HTTPD_FASTCGI_IDLE : MAX_HTTPD_HEADER_TIMEOUT);
+    __sync_fetch_and_add( &stats.connections, 1);
+}
+
+//
+// Out of descriptors, so the connection waiting in the backlog can't be
+// accepted, and the listen socket would wake us again at once, for ever.
+// Give up the spare for long enough to accept it and answer 503. Returns 1
+// if one was shed, 0 if nobody was waiting after all, and -1 if we have no
+// spare either, when we stop accepting for a second.
+//
+static int shed_with_spare( struct httpd *httpd)
+{
+    int ns;
+
+    if ( httpd->spare == -1) httpd->spare = eventfd( 0, EFD_CLOEXEC);
+    if ( httpd->spare == -1) return -1;
+
+    close( httpd->spare);
+    ns = accept4( httpd->sock, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if ( ns != -1) shed_connection( httpd, ns);
+    httpd->spare = eventfd( 0, EFD_CLOEXEC);
+    if ( ns != -1) return 1;
+    return ( errno == EMFILE || errno == ENFILE) ? -1 : 0;
+}
+
+static void pause_accepting( struct httpd *httpd)
+{
+    log_f("Out of descriptors, not accepting on %s for a second\n", httpd->bindName);
+    httpd->acceptPaused = 1;
+#ifdef HTTPD_IO_URING
+    if ( httpd->ring.fd >= 0) return;   // the accept just isn't submitted again
+#endif
+    epoll_ctl( httpd->epoll, EPOLL_CTL_DEL, httpd->sock, 0);
+}
+
+static void resume_accepting( struct httpd *httpd)
+{
+    httpd->acceptPaused = 0;
+#ifdef HTTPD_IO_URING
+    if ( httpd->ring.fd >= 0) {
+	if ( httpd->acceptPolled) ring_poll( httpd, httpd->sock, EPOLLIN, httpd);
+	else ring_accept( httpd);
+	return;
+    }
+#endif
+    {
+	struct epoll_event ev = { .events = EPOLLIN, .data = { .ptr = httpd } };
+
+	if ( epoll_ctl( httpd->epoll, EPOLL_CTL_ADD, httpd->sock, &ev) == -1) {
+	    log_f("Failed to add listener to epoll for HTTPD: %s\n", strerror(errno));
+	}
+    }
+}
+
+static void accept_connections( struct httpd *httpd)
+{
+    for (;;) {
+	struct sockaddr_storage addr = { .ss_family = AF_UNSPEC };
+	socklen_t addrlen = sizeof(addr);
+	int ns;
+
+	ns = accept4( httpd->sock, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if ( ns == -1) {
+	    int shed;
+
+	    if ( errno == EINTR || errno == ECONNABORTED) continue;
+	    if ( errno == EAGAIN || errno == EWOULDBLOCK) return;
+	    if ( errno != EMFILE && errno != ENFILE) {
+		log_f("Failed while accepting connections on %s for HTTPD: %s\n", httpd->bindName, strerror(errno));
+		return;
+	    }
+	    shed = shed_with_spare( httpd);
+	    if ( shed > 0) continue;
+	    if ( shed < 0) pause_accepting( httpd);
+	    return;
+	}
+	add_connection( httpd, ns, &addr);
+    }
+}
+
+//
+// Answer every wait which has timed out, and note when the next one does.
+// A request which answered already may have left waitDue early, which
+// only costs a look.
+//
+static void expire_waits( struct httpd *httpd)
+{
+    uint64_t t = now_ms();
+    struct http_request *r, *next;
+
+    httpd->waitDue = 0;
+    for ( r = httpd->streams; r; r = next) {
+	next = r->streamNext;
+	if ( r->state != CONN_WAITING) continue;
+	if ( r->waitUntil > t) {
+	    if ( !httpd->waitDue || r->waitUntil < httpd->waitDue) httpd->waitDue = r->waitUntil;
+	    continue;
+	}
+	cancel_deadline(r);
+	finish_wait( r, 1);
+	if ( r->state == CONN_CLOSING) cleanup_request(r);
+    }
+#ifdef HTTPD_IO_URING
+    if ( httpd->waitDue && httpd->ring.fd >= 0) ring_wait_timer( httpd);
+#endif
+}
+
+//
+// Turn the wheel up to the current second, closing every connection whose
+// deadline has passed, except that a waiting request gets to answer first.
+// Only the slots for the elapsed seconds are looked at. A FastCGI connection
+// takes its requests with it, and a request can move its connection, so
+// after either the slot is started again.
+//
+static void expire_requests( struct httpd *httpd)
+{
+    time_t t = now();
+
+    if ( t - httpd->wheelTime > MAX_HTTPD_WHEEL) httpd->wheelTime = t - MAX_HTTPD_WHEEL;
+    if ( httpd->acceptPaused) resume_accepting( httpd);
+
+    while ( httpd->wheelTime < t) {
+	struct http_request *r, *next;
+
+	httpd->wheelTime++;
+	for ( r = httpd->wheel[httpd->wheelTime % MAX_HTTPD_WHEEL]; r; r = next) {
+	    int fastcgi = r->fastcgi || r->parent;
+
+	    next = r->timerNext;
+	    if ( r->deadline > httpd->wheelTime) continue;
+	    if ( r->state == CONN_WAITING) {
+		cancel_deadline(r);
+		finish_wait( r, 1);
+		if ( r->state != CONN_CLOSING) continue;
+	    }
+	    log_f("Expiring idle HTTPD connection\n");
+	    cleanup_request(r);
+	    if ( fastcgi) next = httpd->wheel[httpd->wheelTime % MAX_HTTPD_WHEEL];
+	}
+    }
+}
+
+//
+// The socket is ready for something. Move the connection along, and clean
+// it up if that finished it. Returns 0 if it is gone.
+//
+static int connection_event( HTTPD_Request r, unsigned int events)
+{
+    if ( events & (EPOLLERR|EPOLLHUP)) r->state = CONN_CLOSING;
+
+    if ( r->fastcgi) {
+	if ( r->state == CONN_READING && (events & EPOLLOUT)) flush_output(r);
+	if ( r->state == CONN_READING && (events & (EPOLLIN|EPOLLRDHUP))) read_request(r);
+	if ( r->state == CONN_READING) fastcgi_watch(r);
+    } else if ( r->state == CONN_READING && (events & (EPOLLIN|EPOLLRDHUP))) read_request(r);
+    else if ( r->state == CONN_WRITING && (events & EPOLLOUT)) write_response(r);
+    else if ( r->state == CONN_STREAMING && r->messageFunc && (events & EPOLLIN)) read_messages(r);
+    else if ( r->state == CONN_STREAMING && (events & EPOLLRDHUP)) r->state = CONN_CLOSING;
+    else if ( r->state == CONN_WAITING && (events & EPOLLRDHUP)) r->state = CONN_CLOSING;
+    else if ( r->state == CONN_STREAMING && (events & EPOLLOUT)) write_stream(r);
+
+    if ( r->state != CONN_CLOSING) return 1;
+    cleanup_request(r);
+    return 0;
+}
+
+#ifdef HTTPD_IO_URING
+//
+// Handle a batch of completions. Polls are one shot, so whatever fired is
+// re-armed, a connection by watching it again once it has been moved along.
+//
+static void ring_completions( struct httpd *httpd, int *woken, int *resumed)
+{
+    struct ring *ring = &httpd->ring;
+    unsigned int head = *ring->cqHead;
+
+    while ( head != __atomic_load_n( ring->cqTail, __ATOMIC_ACQUIRE)) {
+	struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+	void *tag = (void *)(uintptr_t)cqe->user_data;
+	int res = cqe->res;
+	unsigned int flags = cqe->flags;
+	struct http_request *r;
+
+	__atomic_store_n( ring->cqHead, ++head, __ATOMIC_RELEASE);
+
+	if ( tag == 0) continue;   // a cancellation
+	if ( tag == &httpd->sock) {
+	    if ( res >= 0) {
+		struct sockaddr_storage addr = { .ss_family = AF_UNSPEC };
+		socklen_t addrlen = sizeof(addr);
+
+		getpeername( res, (struct sockaddr *)&addr, &addrlen);
+		add_connection( httpd, res, &addr);
+	    } else if ( res == -EINVAL && !httpd->acceptPolled) {
+		log_f("No multishot accept for HTTPD, polling for connections\n");
+		httpd->acceptPolled = 1;
+		ring_poll( httpd, httpd->sock, EPOLLIN, httpd);
+		continue;
+	    } else if ( res == -EMFILE || res == -ENFILE) {
+		int shed;
+
+		while ( (shed = shed_with_spare( httpd)) > 0);
+		if ( shed < 0 && !httpd->acceptPaused) pause_accepting( httpd);
+	    } else if ( res != -EINTR && res != -ECONNABORTED && res != -EAGAIN) {
+		log_f("Failed while accepting connections on %s for HTTPD: %s\n", httpd->bindName, strerror(-res));
+	    }
+	    if ( !(flags & IORING_CQE_F_MORE) && !httpd->acceptPaused) ring_accept( httpd);
+	    continue;
+	}
+	if ( tag == httpd) {
+	    accept_connections( httpd);
+	    if ( !httpd->acceptPaused) ring_poll( httpd, httpd->sock, EPOLLIN, httpd);
+	    continue;
+	}
+	if ( tag == &httpd->wake) {
+	    *woken = 1;
+	    ring_poll( httpd, httpd->wake, EPOLLIN, &httpd->wake);
+	    continue;
+	}
+	if ( tag == &httpd->resume) {
+	    *resumed = 1;
+	    ring_poll( httpd, httpd->resume, EPOLLIN, &httpd->resume);
+	    continue;
+	}
+	if ( tag == &httpd->tick) {
+	    ring_tick( httpd);
+	    continue;
+	}
+	if ( tag == &httpd->waitTimer) continue;   // the listener looks at waitDue after each batch
+
+	r = tag;
+	r->polling = 0;
+	if ( r->state == CONN_CLOSED) {
+	    if ( !r->armPending) free(r);
+	    continue;
+	}
+	if ( r->working) continue;   // the listener picks it up again in resume_requests()
+	if ( res < 0) {              // cancelled to change its events
+	    watch_request( r, r->events);
+	    continue;
+	}
+	if ( connection_event( r, res)) watch_request( r, r->events);
+    }
+}
+
+//
+// The listener's loop when it has an io_uring. The batch of polls to arm
+// goes in with each wait, so a busy listener makes one system call for
+// the lot rather than one epoll_ctl() each.
+//
+static void ring_listener( struct httpd *httpd)
+{
+    ring_accept( httpd);
+    ring_poll( httpd, httpd->wake, EPOLLIN, &httpd->wake);
+    ring_poll( httpd, httpd->resume, EPOLLIN, &httpd->resume);
+    ring_tick( httpd);
+
+    httpd->wheelTime = now();
+
+    for (;;) {
+	int woken = 0;
+	int resumed = 0;
+
+	arm_requests( httpd);
+	if ( ring_enter( &httpd->ring, 1) == -1) {
+	    if ( errno == EINTR) continue;
+	    log_f("Failed in HTTPD io_uring_enter: %s\n", strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+	ring_completions( httpd, &woken, &resumed);
+
+	if ( resumed) resume_requests(httpd);
+	if ( woken) wake_streams(httpd);
+
+	if ( httpd->waitDue && now_ms() >= httpd->waitDue) expire_waits(httpd);
+	if ( now() != httpd->wheelTime) expire_requests(httpd);
+    }
+}
+#endif
+
+//
+// A socket file left behind by an earlier run would stop us binding. Take
+// it away, unless something is still answering on it.
+//
+static void clear_unix_socket( struct httpd *httpd)
+{
+    const struct sockaddr_un *addr = (struct sockaddr_un *)httpd->bindAddr->ai_addr;
+    struct stat st;
+    int s;
+
+    if ( addr->sun_path[0] == 0) return;   // abstract, nothing on disk
+    if ( lstat( addr->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode)) return;
+
+    s = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( s == -1) return;
+    if ( connect( s, httpd->bindAddr->ai_addr, httpd->bindAddr->ai_addrlen) == 0) {
+	log_f("Something is already listening on %s for HTTPD\n", httpd->bindName);
+	exit(EXIT_FAILURE);
+    }
+    close(s);
+    if ( unlink( addr->sun_path) == -1) {
+	log_f("Failed to remove old socket %s for HTTPD: %s\n", addr->sun_path, strerror(errno));
+    }
+}
+
+//
+// There is one of these threads per daemon. It listens to the port, accepts connections,
+// and runs every connection as a little state machine off of one epoll set.
+//
+static void *listener( struct httpd *httpd)
+{
+    struct epoll_event events[MAX_HTTPD_EVENTS];
+
+    log_f("Starting listener on %s...\n", httpd->bindName);
+
+    httpd->sock = socket(httpd->bindAddr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (httpd->sock == -1) {
+	log_f("Failed to create socket for HTTPD: %s\n", strerror(errno));
+	exit(EXIT_FAILURE);
+    }
+
+    // This tells us to bind even if there are sockets laying around in the TIME_WAIT state.
+    // It is what lets us stop the server and restart immediately without hanging around 30 seconds.
+    {
+	int on = 1;
+	if (setsockopt(httpd->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+	    log_f("Failed to set SO_REUSEADDR for HTTPD: %s\n", strerror(errno));
+	}
+    }
+
+    // With several listeners each has its own socket on the same port, and the
+    // kernel spreads the incoming connections across them. The FastCGI
+    // listener is always alone.
+    if ( listenerCount > 1 && !httpd->fastcgi) {
+	int on = 1;
+	if (setsockopt(httpd->sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+	    log_f("Failed to set SO_REUSEPORT for HTTPD: %s\n", strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    if ( httpd->cpu >= 0) {
+	cpu_set_t cpus;
+
+	CPU_ZERO( &cpus);
+	CPU_SET( httpd->cpu, &cpus);
+	if ( pthread_setaffinity_np( pthread_self(), sizeof(cpus), &cpus)) {
+	    log_f("Failed to pin HTTPD listener to CPU %d\n", httpd->cpu);
+	}
+    }
+
+    if ( !httpd->tcp) clear_unix_socket( httpd);
+
+    if (bind(httpd->sock, httpd->bindAddr->ai_addr, httpd->bindAddr->ai_addrlen) == -1) {
+	log_f("Failed to bind to %s for HTTPD: %s\n", httpd->bindName, strerror(errno));
+	exit(EXIT_FAILURE);
+    }
+
+    if ( !httpd->tcp) {
+	const char *path = ((struct sockaddr_un *)httpd->bindAddr->ai_addr)->sun_path;
+
+	if ( path[0] && chmod( path, socketMode) == -1) {
+	    log_f("Failed to set permissions of %s for HTTPD: %s\n", path, strerror(errno));
+	}
+    }
+
+    if (listen(httpd->sock,MAX_HTTPD_LISTEN_BACKLOG) == -1) {
+	log_f("Failed to listen to port %s for HTTPD: %s\n", httpd->bindName, strerror(errno));
+	exit(EXIT_FAILURE);
+    }
+
+#ifdef HTTPD_IO_URING
+    if ( ring_setup( &httpd->ring) == 0) {
+	ring_listener( httpd);
+	return 0;
+    }
+#endif
+
+    httpd->epoll = epoll_create1( EPOLL_CLOEXEC);
+    if ( httpd->epoll == -1) {
+	log_f("Failed to create epoll for HTTPD: %s\n", strerror(errno));
+	exit(EXIT_FAILURE);
+    }
+    {
+	struct epoll_event ev = { .events = EPOLLIN, .data = { .ptr = httpd } };
+	if ( epoll_ctl( httpd->epoll, EPOLL_CTL_ADD, httpd->sock, &ev) == -1) {
+	    log_f("Failed to add listener to epoll for HTTPD: %s\n", strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+    }
+    {
+	struct epoll_event ev = { .events = EPOLLIN, .data = { .ptr = &httpd->wake } };
+	if ( epoll_ctl( httpd->epoll, EPOLL_CTL_ADD, httpd->wake, &ev) == -1) {
+	    log_f("Failed to add wake event to epoll for HTTPD: %s\n", strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+    }
+    {
+	struct epoll_event ev = { .events = EPOLLIN, .data = { .ptr = &httpd->resume } };
+	if ( epoll_ctl( httpd->epoll, EPOLL_CTL_ADD, httpd->resume, &ev) == -1) {
+	    log_f("Failed to add resume event to epoll for HTTPD: %s\n", strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    httpd->wheelTime = now();
+
+    for (;;) {
+	int i, n;
+	int woken = 0;
+	int resumed = 0;
+	int timeout = 1000;
+
+	if ( httpd->waitDue) {
+	    uint64_t t = now_ms();
+
+	    if ( httpd->waitDue <= t) timeout = 0;
+	    else if ( httpd->waitDue - t < timeout) timeout = httpd->waitDue - t;
+	}
+	n = epoll_wait( httpd->epoll, events, MAX_HTTPD_EVENTS, timeout);
+	if ( n == -1) {
+	    if ( errno == EINTR) continue;
+	    log_f("Failed in HTTPD epoll_wait: %s\n", strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+
+	for ( i = 0; i < n; i++) {
+	    struct http_request *r;
+
+	    if ( events[i].data.ptr == httpd) {
+		accept_connections(httpd);
+		continue;
+	    }
+	    if ( events[i].data.ptr == &httpd->wake) {
+		woken = 1;   // after this batch, so no stream is freed under a pending event
+		continue;
+	    }
+	    if ( events[i].data.ptr == &httpd->resume) {
+		resumed = 1;   // likewise
+		continue;
+	    }
+
+	    r = events[i].data.ptr;
+	    if ( r->working) continue;   // the listener picks it up again in resume_requests()
+	    connection_event( r, events[i].events);
+	}
+
+	if ( resumed) resume_requests(httpd);
+	if ( woken) wake_streams(httpd);
+
+	if ( httpd->waitDue && now_ms() >= httpd->waitDue) expire_waits(httpd);
+	if ( now() != httpd->wheelTime) expire_requests(httpd);
+    }
+
+    return 0;
+}
+
+//
+// unix:/path/name binds a socket file, and unix:@name one in the abstract
+// namespace, which has no file and pays no attention to a chroot. We make
+// an addrinfo for it, just as getaddrinfo() would for a TCP port.
+//
+static struct addrinfo *unix_address( const char *name)
+{
+    struct addrinfo *ai = calloc( 1, sizeof(*ai) + sizeof(struct sockaddr_un));
+    struct sockaddr_un *addr = (struct sockaddr_un *)(ai + 1);
+    size_t len = strlen(name);
+
+    if ( !ai) {
+	log_f("Failed to allocate HTTPD unix address\n");
+	exit(1);
+    }
+    if ( len == 0 || len >= sizeof(addr->sun_path)) {
+	log_f("HTTPD_Start unix socket name `%s' is too %s\n", name, len ? "long" : "short");
+	exit(1);
+    }
+    addr->sun_family = AF_UNIX;
+    memcpy( addr->sun_path, name, len);
+    if ( name[0] == '@') addr->sun_path[0] = 0;
+
+    ai->ai_family = AF_UNIX;
+    ai->ai_socktype = SOCK_STREAM;
+    ai->ai_addr = (struct sockaddr *)addr;
+    ai->ai_addrlen = offsetof( struct sockaddr_un, sun_path) + len + (name[0] != '@');   // the abstract name's length is exact
+    return ai;
+}
+
+//
+// Resolve [addr:]port, or unix:name, to bind to.
+//
+static struct addrinfo *bind_address( const char *bindPort)
+{
+    char node[256]="",serv[256]="";
+    struct addrinfo *bindAddr;
+    int r;
+    struct addrinfo hints = { .ai_family = AF_INET,
+			      .ai_socktype = SOCK_STREAM,
+			      .ai_flags = AI_PASSIVE, };
+
+    if ( strncmp( bindPort, "unix:", 5) == 0) return unix_address( bindPort + 5);
+
+    if ( strchr( bindPort, ':')) sscanf( bindPort, "%255[^:]:%255s",node,serv);
+    else sscanf( bindPort, "%255s", serv);
+
+    if ( (r = getaddrinfo( node[0]?node:NULL, serv, &hints, &bindAddr)) ) {
+      log_f("HTTPD_Start getaddrinfo failed (%s:%s): %s\n", node,serv,gai_strerror(r));
+	exit(1);
+    }
+    return bindAddr;
+}
+
+static pthread_t start_listener( const char *bindPort, struct addrinfo *bindAddr,
+				 void (*func)(HTTPD_Request req, const char *method, const char *url), int cpu, int fastcgi)
+{
+    struct httpd *h = calloc(sizeof(struct httpd),1);
+
+    if ( !h) {
+	log_f("Failed to allocate HTTPD listener\n");
+	exit(1);
+    }
+    h->func = func;
+    h->bindName = bindPort;
+    h->bindAddr = bindAddr;
+    h->tcp = ( bindAddr->ai_family != AF_UNIX);
+    h->fastcgi = fastcgi;
+    h->cpu = cpu;
+
+    h->wake = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+    h->resume = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+    h->spare = eventfd( 0, EFD_CLOEXEC);
+    if ( h->wake == -1 || h->resume == -1 || h->spare == -1) {
+	log_f("Failed to create HTTPD wake event: %s\n", strerror(errno));
+	exit(1);
+    }
+    pthread_mutex_init( &h->resumeMutex, NULL);
+
+    if ( pthread_create( &h->thread, NULL, (Pfunc)listener, h)) {
+      log_f("Failed to start HTTPD thread: %s", strerror(errno));
+	exit(1);
+    }
+
+    pthread_mutex_lock( &httpdsMutex);
+    h->nextHttpd = httpds;
+    httpds = h;
+    pthread_mutex_unlock( &httpdsMutex);
+
+    return h->thread;
+}
+
+//
+// Each connection takes a descriptor, so a limit past what RLIMIT_NOFILE
+// leaves us would have accept() fail before we ever shed with a 503. Allow
+// for those already open, the handful each listener needs, one more
+// listener for FastCGI, and some to spare for memfds and the like.
+//
+static void clamp_connections( void)
+{
+    struct rlimit rl;
+    long open = 0, room;
+    int fd;
+
+    if ( getrlimit( RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY) return;
+
+    for ( fd = 0; fd < rl.rlim_cur && fd < 65536; fd++) {
+	if ( fcntl( fd, F_GETFD) != -1) open++;
+    }
+    room = (long)rl.rlim_cur - open - 5 * (listenerCount + 1) - 16;
+    if ( room < 1) room = 1;
+    if ( maxConnections > room) {
+	warn_f("RLIMIT_NOFILE is %ld, limiting HTTP connections to %ld rather than %d\n",
+	       (long)rl.rlim_cur, room, maxConnections);
+	maxConnections = room;
+    }
+}
+
+//
+// Start the listeners. Each one is a thread with its own socket, epoll set and
+// connections. The first one's thread is returned.
+//
+pthread_t HTTPD_Start( const char *bindPort, void (*func)(HTTPD_Request req, const char *method, const char *url) )
+{
+    struct addrinfo *bindAddr = bind_address( bindPort);
+    pthread_t first = 0;
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN);
+    int i;
+
+    if ( bindAddr->ai_family == AF_UNIX && listenerCount > 1) {
+	log_f("A unix socket can't be shared by listeners, using one\n");
+	listenerCount = 1;
+    }
+    if ( cpus < 1) cpus = 1;
+    clamp_connections();
+
+    for ( i = 0; i < listenerCount; i++) {
+	pthread_t t = start_listener( bindPort, bindAddr, func, listenerAffinity ? i % cpus : -1, 0);
+
+	if ( i == 0) first = t;
+    }
+
+    for ( i = 0; i < workerCount; i++) {
+	pthread_t t;
+
+	if ( pthread_create( &t, NULL, (Pfunc)worker, NULL)) {
+	    log_f("Failed to start HTTPD worker: %s", strerror(errno));
+	    exit(1);
+	}
+	pthread_detach(t);
+    }
+
+    return first;
+}
+
+//
+// Start one more listener, for web servers passing requests on by FastCGI.
+// They go to the same func as HTTP requests, but always on this listener.
+//
+pthread_t HTTPD_Start_FastCGI( const char *bindPort, void (*func)(HTTPD_Request req, const char *method, const char *url) )
+{
+    return start_listener( bindPort, bind_address( bindPort), func, -1, 1);
+}
+
+void HTTPD_Set_Limits( int connections, int streams)
+{
+    maxConnections = connections;
+    maxStreams = streams;
+}
+
+void HTTPD_Set_Listeners( int count, int affinity)
+{
+    listenerCount = count > 0 ? count : 1;
+    listenerAffinity = affinity;
+}
+
+void HTTPD_Set_Workers( int count)
+{
+    workerCount = count > 0 ? count : 0;
+}
+
+void HTTPD_Set_Socket_Mode( int mode)
+{
+    socketMode = mode;
+}
+
+void HTTPD_Get_Stats( struct httpd_stats *s)
+{
+    *s = stats;
+}
+
+//
+// Called from the capture thread when a new frame is ready. Cheap enough to
+// do every frame, it is one write() per httpd.
+//
+void HTTPD_Wake_Streams(void)
+{
+    struct httpd *h;
+    uint64_t poke = 1;
+
+    pthread_mutex_lock( &httpdsMutex);
+    for ( h = httpds; h; h = h->nextHttpd) {
+	if ( write( h->wake, &poke, sizeof(poke)) == -1 && errno != EAGAIN) {
+	    log_f("Failed to wake HTTPD streams: %s\n", strerror(errno));
+	}
+    }
+    pthread_mutex_unlock( &httpdsMutex);
+}
+
+//
+// A send has failed, so the connection is finished. A worker only notes
+// that, and the listener closes it once it has the request back.
+//
+static void fail_request( HTTPD_Request req)
+{
+    if ( req->working) req->failed = 1;
+    else req->state = CONN_CLOSING;
+}
+
+static int request_failed( HTTPD_Request req)
+{
+    return req->state == CONN_CLOSING || req->failed;
+}
+
+//
+// Queue a copy of the pieces, less the first 'skip' bytes which have been
+// sent, for the listener to finish when the socket drains.
+//
+static int queue_output( HTTPD_Request req, const struct iovec *iov, int n, size_t skip)
+{
+    size_t togo = 0;
+    struct out_buf *o;
+    char *d;
+    int i;
+
+    for ( i = 0; i < n; i++) togo += iov[i].iov_len;
+
+    o = malloc( sizeof(*o) + togo - skip);
+    if ( !o) {
+	log_f("Failed to allocate HTTPD output buffer\n");
+	fail_request( req);
+	return 0;
+    }
+    o->next = 0;
+    o->length = togo - skip;
+    o->offset = 0;
+    o->fd = -1;
+    for ( i = 0, d = o->data; i < n; i++) {
+	size_t len = iov[i].iov_len;
+	const char *b = iov[i].iov_base;
+
+	if ( skip >= len) {
+	    skip -= len;
+	    continue;
+	}
+	memcpy( d, b + skip, len - skip);
+	d += len - skip;
+	skip = 0;
+    }
+    *req->outTail = o;
+    req->outTail = &o->next;
+    return 1;
+}
+
+//
+// Send what we can of the pieces right now with one sendmsg(), and queue a
+// single copy of whatever is left for the listener to finish when the socket
+// drains. Any status and headers waiting in the head buffer go out in front
+// of the pieces. Never blocks.
+//
+static int Send_Vector( HTTPD_Request req, const struct iovec *pieces, int count)
+{
+    struct iovec iov[MAX_HTTPD_HELD+MAX_HTTPD_CHUNKS+2];
+    size_t togo = 0;
+    size_t sent = 0;
+    struct out_buf *o;
+    int i, first, n = 0;
+
+    if ( req->parent) return fastcgi_send( req, pieces, count);
+    if ( request_failed( req)) return 0;
+
+    // Responses held back for coalescing go out first, in the same sendmsg().
+    for ( o = req->held ? req->out : 0; o; o = o->next) {
+	iov[n].iov_base = o->data;
+	iov[n].iov_len = o->length;
+	n++;
+    }
+    first = n;
+
+    if ( req->headUsed) {
+	iov[n].iov_base = req->head;
+	iov[n].iov_len = req->headUsed;
+	n++;
+	req->headUsed = 0;
+    }
+    if ( count > MAX_HTTPD_CHUNKS+2 - (n - first)) {
+	log_f("Too many pieces for HTTPD Send_Vector: %d\n", count);
+	fail_request( req);
+	return 0;
+    }
+    for ( i = 0; i < count; i++) iov[n++] = pieces[i];
+
+    for ( i = first; i < n; i++) togo += iov[i].iov_len;
+
+    //
+    // While more pipelined requests are waiting to be answered, small
+    // responses are held back so that several go out together.
+    //
+    if ( req->coalesce && req->keepAlive && (!req->out || req->held) &&
+	 req->held < MAX_HTTPD_HELD && req->heldBytes + togo <= MAX_HTTPD_COALESCE) {
+	if ( togo == 0) return 1;
+	if ( !queue_output( req, iov + first, n - first, 0)) return 0;
+	req->held++;
+	req->heldBytes += togo;
+	return 1;
+    }
+    if ( togo == 0 && !req->held) return 1;
+
+    while( !req->out || req->held) {
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+	ssize_t c = sendmsg( req->socket, &msg, MSG_NOSIGNAL);
+
+	if ( c == -1 && errno == EINTR) continue;
+	if ( c == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+	if ( c == -1) {
+	    log_f("Error sending on HTTPD: %s\n", strerror(errno));
+	    fail_request( req);
+	    return 0;
+	}
+	sent = c;
+	break;
+    }
+
+    // Whatever is left of the held responses is just queued output now.
+    for ( ; req->held; req->held--) {
+	o = req->out;
+	if ( sent < o->length) {
+	    o->offset = sent;
+	    sent = 0;
+	    break;
+	}
+	sent -= o->length;
+	req->out = o->next;
+	if ( !req->out) req->outTail = &req->out;
+	free_out(o);
+    }
+    req->held = 0;
+    req->heldBytes = 0;
+
+    if ( sent == togo) return 1;
+    return queue_output( req, iov + first, n - first, sent);
+}
+
+//
+// Add to the status and headers we are collecting. They are sent with the
+// first piece of body, or on their own if they fill the buffer.
+//
+static void Add_Head( HTTPD_Request req, const char *h, int len)
+{
+    if ( req->headUsed + len > sizeof(req->head)) {
+	struct iovec iov = { .iov_base = (void *)h, .iov_len = len };
+
+	Send_Vector( req, &iov, 1);
+	return;
+    }
+    memcpy( req->head + req->headUsed, h, len);
+    req->headUsed += len;
+}
+
+void HTTPD_Send_Status(HTTPD_Request req, int status, const char *text)
+{
+    char buf[1024];
+
+    if ( req->sentStatus) return;
+    if ( req->parent) {
+	snprintf( buf, sizeof(buf)-1, "Status: %3d %s\r\n", status, text);
+    } else if ( req->protocol >= 0x11 ) {
+	if ( !req->keepAlive) {
+	    snprintf( buf, sizeof(buf)-1, "HTTP/1.1 %3d %s\r\nConnection: close\r\n", status, text);
+	} else {
+	    snprintf( buf, sizeof(buf)-1, "HTTP/1.1 %3d %s\r\n", status, text);
+	}
+    } else {
+	snprintf( buf, sizeof(buf)-1, "HTTP/1.0 %3d \r\n", status);
+    }
+
+
+    Add_Head( req, buf, strlen(buf));
+    req->sentStatus = 1;
+}
+
+void HTTPD_Add_Header(HTTPD_Request req, const char *h)
+{
+  if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
+
+    Add_Head(req, h, strlen(h));
+    Add_Head(req, "\r\n", 2);
+}
+
+void HTTPD_Send_Body(HTTPD_Request req, const void *data, int length)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = length };
+    char buf[64];
+
+    if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
+
+    snprintf( buf, sizeof(buf), "Content-length: %d\r\n\r\n", length);
+    Add_Head( req, buf, strlen(buf));
+
+    Send_Vector( req, &iov, 1);
+}
+
+//
+// Send a response which was put together ahead of time. The first piece
+// holds every header, Content-length and the blank line included, so only
+// the status line is added. It all goes in one sendmsg().
+//
+void HTTPD_Send_Prebuilt(HTTPD_Request req, const struct iovec *pieces, int count)
+{
+    if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
+
+    Send_Vector( req, pieces, count);
+}
+
+//
+// Send length bytes of the file from offset after whatever is already on
+// its way, queueing a dup() of the file for the rest if the socket is full.
+//
+static void send_file_range( HTTPD_Request req, int fd, off_t off, unsigned int length)
+{
+    struct out_buf *o;
+
+    while ( !req->out && length > 0) {
+	ssize_t c = sendfile( req->socket, fd, &off, length);
+
+	if ( c == -1 && errno == EINTR) continue;
+	if ( c == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+	if ( c <= 0) {
+	    log_f("Error sending file on HTTPD: %s\n", c ? strerror(errno) : "short file");
+	    fail_request( req);
+	    return;
+	}
+	length -= c;
+    }
+    if ( length == 0) return;
+
+    o = malloc( sizeof(*o));
+    if ( !o) {
+	log_f("Failed to allocate HTTPD output buffer\n");
+	fail_request( req);
+	return;
+    }
+    o->next = 0;
+    o->offset = off;
+    o->length = off + length;
+    o->fd = fcntl( fd, F_DUPFD_CLOEXEC, 0);
+    if ( o->fd == -1) {
+	log_f("Failed to dup file for HTTPD: %s\n", strerror(errno));
+	free(o);
+	fail_request( req);
+	return;
+    }
+    *req->outTail = o;
+    req->outTail = &o->next;
+}
+
+//
+// Send the pieces, then length bytes of the file from offset with sendfile(),
+// so the kernel takes the data straight from the page cache. If the socket
+// can't take it all we keep a dup() of the file, so the caller may close
+// theirs as soon as we return, but must not change what is in it.
+//
+// For FastCGI the file goes out in STDOUT records, each header sent ahead
+// of its piece of the file.
+//
+void HTTPD_Send_File(HTTPD_Request req, const struct iovec *pieces, int count, int fd, unsigned int offset, unsigned int length)
+{
+    int coalesce = req->coalesce;
+
+    if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
+
+    if ( req->parent) {
+	if ( !Send_Vector( req, pieces, count)) return;
+	while ( length > 0) {
+	    unsigned int piece = length > 65535 ? 65535 : length;
+	    unsigned char h[8];
+	    struct iovec iov = { .iov_base = h, .iov_len = sizeof(h) };
+
+	    fastcgi_header( h, FCGI_STDOUT, req->requestId, piece);
+	    if ( Send_Vector( req->parent, &iov, 1)) send_file_range( req->parent, fd, offset, piece);
+	    if ( request_failed( req->parent)) {
+		req->state = CONN_CLOSING;
+		return;
+	    }
+	    offset += piece;
+	    length -= piece;
+	}
+	return;
+    }
+
+    req->coalesce = 0;   // the file can't be held, so nothing in front of it may be
+    if ( !Send_Vector( req, pieces, count)) return;
+    req->coalesce = coalesce;
+
+    send_file_range( req, fd, offset, length);
+}
+
+//
+// Send a body a piece at a time, for when its length isn't known up front.
+// The first call finishes the headers with Transfer-Encoding: chunked. Small
+// pieces are gathered into a bounded buffer and go out as one chunk when it
+// fills, on HTTPD_Push(), or when the handler returns, at which point the
+// body is ended for you. Large pieces go straight out without a copy.
+//
+void HTTPD_Send_Body_Chunk(HTTPD_Request req, const void *data, int length)
+{
+    if ( !req->chunked) {
+	if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
+	if ( req->protocol >= 0x11) {
+	    Add_Head( req, "Transfer-Encoding: chunked\r\n\r\n", 30);
+	    req->chunked = 1;
+	} else {
+	    Add_Head( req, "\r\n", 2);
+	    req->chunked = -1;
+	    req->keepAlive = 0;
+	}
+    }
+    if ( length <= 0) return;
+
+    if ( req->chunkUsed + length > MAX_HTTPD_CHUNK_BUFFER) flush_chunks( req);
+    if ( length >= MAX_HTTPD_CHUNK_BUFFER) {
+	send_chunk( req, data, length);
+	return;
+    }
+    if ( !req->chunkBuf && !(req->chunkBuf = malloc( MAX_HTTPD_CHUNK_BUFFER))) {
+	log_f("Failed to allocate HTTPD chunk buffer\n");
+	send_chunk( req, data, length);
+	return;
+    }
+    memcpy( req->chunkBuf + req->chunkUsed, data, length);
+    req->chunkUsed += length;
+}
+
+//
+// Send what has been gathered of a chunked body now, and push it out of the
+// cork, rather than waiting for more or for the end.
+//
+void HTTPD_Push( HTTPD_Request req)
+{
+    if ( req->chunkUsed) flush_chunks( req);
+    Send_Vector( req, 0, 0);
+    if ( !req->out && !request_failed( req)) push_output( req);
+}
+
+//
+// Some responses, like 304 Not Modified, must not have a body at all, not
+// even an empty one, so there is no Content-length either.
+//
+void HTTPD_Send_No_Body(HTTPD_Request req)
+{
+    if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
+
+    Add_Head( req, "\r\n", 2);
+    Send_Vector( req, 0, 0);
+}
+
+
+//
+// Turn this request into a stream. The header block is finished here and the
+// connection will close when the stream does, so there is no Content-length.
+// The func is called right away and again whenever a new frame arrives, and
+// should send its data with HTTPD_Send_Stream_Chunks().
+//
+// If there are already too many streams the client gets a 503 instead, and
+// we return 0. So does a FastCGI request, with a 501, since the web server
+// would be holding it open for good.
+//
+static int admit_stream( HTTPD_Request req)
+{
+    if ( req->parent) {
+	req->headUsed = 0;
+	req->sentStatus = 0;
+	HTTPD_Send_Status( req, 501, "Not Implemented");
+	HTTPD_Send_Body( req, "501 - Streams need HTTP, not FastCGI", 36);
+	return 0;
+    }
+    if ( __sync_add_and_fetch( &stats.streams, 1) > maxStreams) {
+	struct iovec iov = { .iov_base = (void *)busyResponse, .iov_len = sizeof(busyResponse)-1 };
+
+	log_f("Too many HTTPD streams, shedding one.\n");
+	__sync_fetch_and_sub( &stats.streams, 1);
+	__sync_fetch_and_add( &stats.shedStreams, 1);
+	req->headUsed = 0;    // forget whatever headers the handler had in mind
+	req->sentStatus = 1;
+	req->keepAlive = 0;
+	Send_Vector( req, &iov, 1);
+	return 0;
+    }
+    return 1;
+}
+
+int HTTPD_Stream( HTTPD_Request req, void (*func)(HTTPD_Request req))
+{
+    req->coalesce = 0;   // nothing after this gets answered
+    if ( !admit_stream(req)) {
+	free( req->streamContext);
+	req->streamContext = 0;
+	return 0;
+    }
+
+    if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
+    if ( req->keepAlive) {
+	HTTPD_Add_Header( req, "Connection: close");
+	req->keepAlive = 0;
+    }
+    Add_Head( req, "\r\n", 2);
+
+    req->streamFunc = func;
+    push_frame(req);
+    Send_Vector( req, 0, 0);   // in case there was no frame to go with the headers
+    return 1;
+}
+
+//
+// Just enough SHA-1 for the WebSocket handshake, the input must be short.
+//
+#define ROL(x,n) (((x) << (n)) | ((x) >> (32-(n))))
+
+static void sha1( const unsigned char *data, size_t len, unsigned char *out)
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    unsigned char m[256];
+    size_t total = (len + 8) / 64 * 64 + 64;
+    size_t i;
+    int t;
+
+    memset( m, 0, total);
+    memcpy( m, data, len);
+    m[len] = 0x80;
+    for ( i = 0; i < 8; i++) m[total-1-i] = ((uint64_t)len * 8) >> (8*i);
+
+    for ( i = 0; i < total; i += 64) {
+	uint32_t w[80], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+	for ( t = 0; t < 16; t++) {
+	    w[t] = (uint32_t)m[i+4*t] << 24 | (uint32_t)m[i+4*t+1] << 16 | (uint32_t)m[i+4*t+2] << 8 | m[i+4*t+3];
+	}
+	for ( ; t < 80; t++) w[t] = ROL( w[t-3] ^ w[t-8] ^ w[t-14] ^ w[t-16], 1);
+
+	for ( t = 0; t < 80; t++) {
+	    uint32_t f, k, tmp;
+
+	    if ( t < 20) { f = (b & c) | (~b & d); k = 0x5a827999; }
+	    else if ( t < 40) { f = b ^ c ^ d; k = 0x6ed9eba1; }
+	    else if ( t < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+	    else { f = b ^ c ^ d; k = 0xca62c1d6; }
+
+	    tmp = ROL(a,5) + f + e + k + w[t];
+	    e = d;
+	    d = c;
+	    c = ROL(b,30);
+	    b = a;
+	    a = tmp;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+    }
+    for ( i = 0; i < 20; i++) out[i] = h[i/4] >> (24 - 8*(i%4));
+}
+
+static void base64encode( char *out, const unsigned char *in, int len)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+
+    for ( i = 0; i < len; i += 3) {
+	uint32_t v = in[i] << 16 | (i+1 < len ? in[i+1] << 8 : 0) | (i+2 < len ? in[i+2] : 0);
+
+	*out++ = digits[(v >> 18) & 63];
+	*out++ = digits[(v >> 12) & 63];
+	*out++ = i+1 < len ? digits[(v >> 6) & 63] : '=';
+	*out++ = i+2 < len ? digits[v & 63] : '=';
+    }
+    *out = 0;
+}
+
+//
+// Upgrade this request to a WebSocket and stream frames down it, one binary
+// message each, sent by func with HTTPD_Send_Message(). Anything the client
+// sends us comes to message. Like HTTPD_Stream(), returns 0 if we didn't,
+// in which case the client has been told why.
+//
+int HTTPD_WebSocket( HTTPD_Request req, void (*func)(HTTPD_Request req),
+		     void (*message)(HTTPD_Request req, const char *data, int length))
+{
+    const char *upgrade = find_header( req, "Upgrade");
+    const char *key = find_header( req, "Sec-WebSocket-Key");
+    const char *version = find_header( req, "Sec-WebSocket-Version");
+    char buf[MAX_HTTPD_WEBSOCKET_KEY + sizeof(WEBSOCKET_GUID)];
+    unsigned char digest[20];
+    char accept[32];
+
+    if ( !upgrade || strcasecmp( upgrade, "websocket") != 0 || !key ||
+	 strlen(key) > MAX_HTTPD_WEBSOCKET_KEY || req->protocol < 0x11) {
+	HTTPD_Send_Status( req, 400, "Bad Request");
+	HTTPD_Send_Body( req, "400 - WebSocket only", 20);
+	return 0;
+    }
+    if ( !version || strcmp( version, "13") != 0) {
+	HTTPD_Send_Status( req, 426, "Upgrade Required");
+	HTTPD_Add_Header( req, "Sec-WebSocket-Version: 13");
+	HTTPD_Send_Body( req, "426 - WebSocket version 13 only", 31);
+	return 0;
+    }
+    req->coalesce = 0;
+    if ( !admit_stream(req)) return 0;
+
+    snprintf( buf, sizeof(buf), "%s" WEBSOCKET_GUID, key);
+    sha1( (unsigned char *)buf, strlen(buf), digest);
+    base64encode( accept, digest, sizeof(digest));
+
+    req->headUsed = 0;
+    req->sentStatus = 0;
+    req->keepAlive = 1;   // so no Connection: close goes with the status
+    HTTPD_Send_Status( req, 101, "Switching Protocols");
+    HTTPD_Add_Header( req, "Upgrade: websocket");
+    HTTPD_Add_Header( req, "Connection: Upgrade");
+    snprintf( buf, sizeof(buf), "Sec-WebSocket-Accept: %s", accept);
+    HTTPD_Add_Header( req, buf);
+    Add_Head( req, "\r\n", 2);
+    req->keepAlive = 0;
+
+    req->streamFunc = func;
+    req->messageFunc = message;
+    push_frame(req);
+    Send_Vector( req, 0, 0);
+    return 1;
+}
+
+//
+// The pieces make a single binary message.
+//
+void HTTPD_Send_Message( HTTPD_Request req, const struct iovec *chunks, int count)
+{
+    struct iovec iov[MAX_HTTPD_CHUNKS];
+    unsigned char h[10];
+    uint64_t length = 0;
+    int i;
+
+    if ( count > MAX_HTTPD_CHUNKS-1) count = MAX_HTTPD_CHUNKS-1;   // Send_Vector() would refuse anyway
+    for ( i = 0; i < count; i++) {
+	iov[i+1] = chunks[i];
+	length += chunks[i].iov_len;
+    }
+    iov[0].iov_base = h;
+    iov[0].iov_len = websocket_header( h, 0x2, length);
+    Send_Vector( req, iov, count+1);
+}
+
+//
+// Throttle a stream. A paused one is sent nothing, and one with a rate is
+// sent the frames which come nearest to it without going over.
+//
+void HTTPD_Stream_Pause( HTTPD_Request req, int paused)
+{
+    req->paused = paused;
+}
+
+void HTTPD_Stream_Rate( HTTPD_Request req, int fps)
+{
+    req->frameInterval = fps > 0 ? 1000 / fps : 0;
+}
+
+//
+// A stream which has an end, such as a clip, says so from its func. Once
+// everything it sent has gone the connection is closed.
+//
+void HTTPD_Stream_End( HTTPD_Request req)
+{
+    req->streamEnded = 1;
+}
+
+//
+// Somewhere for the handler to keep what its stream func needs, since the
+// url is gone by the time that runs.
+//
+void HTTPD_Set_Stream_Context( HTTPD_Request req, void *context)
+{
+    req->streamContext = context;
+}
 
-    snprintf( buf, sizeof(buf)-1, "Content-length: %d\r\n\r\n", length);
-    Send_Buffer( req, buf, strlen(buf));
+void *HTTPD_Get_Stream_Context( HTTPD_Request req)
+{
+    return req->streamContext;
+}
 
-    Send_Buffer(req, data, length);
+void HTTPD_Send_Stream_Chunks( HTTPD_Request req, const struct iovec *chunks, int count)
+{
+    Send_Vector( req, chunks, count);
 }
 
+//
+// Answer this request later. Once the handler returns, func is called on
+// the listener each time a new frame arrives until it returns nonzero to say
+// it has sent a response, or at the end of the timeout with 'expired' set,
+// when it must. Nothing blocks meanwhile, and the request's url and headers
+// are still there to look at.
+//
+void HTTPD_Wait( HTTPD_Request req, int (*func)(HTTPD_Request req, int expired), unsigned long ms)
+{
+    if ( ms < 1) ms = 1;
+    if ( ms > MAX_HTTPD_WAIT * 1000) ms = MAX_HTTPD_WAIT * 1000;
+
+    req->waitFunc = func;
+    req->waitMs = ms;   // the wheel is the listener's, start_wait() sets the deadline
+}
 
 const char *HTTPD_Get_Authorization( HTTPD_Request req)
 {
-    if ( req->authorization[0] == 0) return NULL;
-    else return req->authorization;
+    return req->authorization;
+}
+
+const char *HTTPD_Get_Header( HTTPD_Request req, const char *name)
+{
+    return find_header( req, name);
 }
 
+const char *HTTPD_Get_Url( HTTPD_Request req)
+{
+    return req->url;
+}
@@ -2,17 +2,50 @@
 #define HTTPD_IS_IN
 
 #include <pthread.h>
+#include <sys/uio.h>
 
 typedef struct http_request *HTTPD_Request;
 
+struct httpd_stats {
+    int connections;              // open right now
+    int streams;
+    unsigned long shedConnections;   // turned away with a 503 since we started
+    unsigned long shedStreams;
+    unsigned long droppedFrames;     // skipped by streams too slow to keep up
+};
+
 pthread_t HTTPD_Start(const char *bindName, void (*func)(HTTPD_Request req, const char *method, const char *url) );
+pthread_t HTTPD_Start_FastCGI(const char *bindName, void (*func)(HTTPD_Request req, const char *method, const char *url) );  // a FastCGI responder too
+void HTTPD_Set_Limits( int connections, int streams);   // before HTTPD_Start()
+void HTTPD_Set_Listeners( int count, int affinity);     // before HTTPD_Start(), affinity pins listener N to CPU N
+void HTTPD_Set_Workers( int count);                      // before HTTPD_Start(), 0 runs handlers on the listeners
+void HTTPD_Set_Socket_Mode( int mode);                   // before HTTPD_Start(), permissions for a unix: socket
+void HTTPD_Get_Stats( struct httpd_stats *stats);
 
 void HTTPD_Send_Status( HTTPD_Request req, int status, const char *text);      // optional, will be sent as 200 if you try to skip it
 void HTTPD_Add_Header( HTTPD_Request req, const char *h);  // optional
 void HTTPD_Send_Body( HTTPD_Request req, const void *data, int length);
+void HTTPD_Send_Prebuilt( HTTPD_Request req, const struct iovec *pieces, int count);  // the first piece is the whole header block
+void HTTPD_Send_File( HTTPD_Request req, const struct iovec *pieces, int count, int fd, unsigned int offset, unsigned int length);  // pieces, then the file by sendfile()
+void HTTPD_Send_No_Body( HTTPD_Request req);   // finish the headers with nothing after them, e.g. for a 304
 void HTTPD_Send_Body_Chunk(HTTPD_Request req, const void *data, int length);
 void HTTPD_Push( HTTPD_Request req);
 
-const char *HTTPD_Get_Authorization( HTTPD_Request req);  // NULL if none given
+int HTTPD_Stream( HTTPD_Request req, void (*func)(HTTPD_Request req));   // call func now and for each new frame until the client leaves, 0 if too busy
+void HTTPD_Send_Stream_Chunks( HTTPD_Request req, const struct iovec *chunks, int count);
+void HTTPD_Wake_Streams(void);   // a new frame is ready, safe from any thread
+int HTTPD_WebSocket( HTTPD_Request req, void (*func)(HTTPD_Request req),   // as HTTPD_Stream, and messages from the client go to message
+		     void (*message)(HTTPD_Request req, const char *data, int length));
+void HTTPD_Send_Message( HTTPD_Request req, const struct iovec *chunks, int count);   // one binary WebSocket message
+void HTTPD_Stream_Pause( HTTPD_Request req, int paused);
+void HTTPD_Stream_Rate( HTTPD_Request req, int fps);   // at most this many frames a second, 0 for all of them
+void HTTPD_Stream_End( HTTPD_Request req);   // from the stream func, hang up once what has been sent is gone
+void HTTPD_Set_Stream_Context( HTTPD_Request req, void *context);   // before HTTPD_Stream(), free()d when the stream ends
+void *HTTPD_Get_Stream_Context( HTTPD_Request req);
+void HTTPD_Wait( HTTPD_Request req, int (*func)(HTTPD_Request req, int expired), unsigned long ms);  // answer from func when a frame comes, at most 60s
+
+const char *HTTPD_Get_Authorization( HTTPD_Request req);  // NULL if none given, only valid inside the handler or a wait func
+const char *HTTPD_Get_Header( HTTPD_Request req, const char *name);  // NULL if none given, only valid inside the handler or a wait func
+const char *HTTPD_Get_Url( HTTPD_Request req);   // only valid inside the handler or a wait func
 
 #endif
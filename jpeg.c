@@ -0,0 +1,87 @@
+/*
+** memchr() finds the 0xff bytes in the compressed data for us, glibc has it
+** in SSE2, AVX2 and NEON, which is quicker than any loop we'd write here.
+*/
+#include <string.h>
+
+#include "tinycamd.h"
+
+#define JPEG_TEM 0x01
+#define JPEG_RST0 0xd0
+#define JPEG_RST7 0xd7
+#define JPEG_SOI 0xd8
+#define JPEG_EOI 0xd9
+#define JPEG_SOS 0xda
+#define JPEG_DHT 0xc4
+
+static void add_segment( struct jpeg_index *ix, unsigned char marker, unsigned int offset, unsigned int length)
+{
+    if ( ix->count < JPEG_SEGMENTS) {
+	ix->segments[ix->count].offset = offset;
+	ix->segments[ix->count].length = length;
+	ix->segments[ix->count].marker = marker;
+    }
+    ix->count++;
+}
+
+/*
+** Step over the compressed data of a scan, which begins at i. Any 0xff in it
+** is either stuffed with a 0x00 after it or is a restart marker, so the first
+** other one is the marker after the scan. Returns its offset, or len if the
+** data just stops.
+*/
+static unsigned int skip_scan( const unsigned char *p, unsigned int i, unsigned int len)
+{
+    const unsigned char *ff;
+
+    while ( i < len && (ff = memchr( p + i, 0xff, len - i))) {
+	i = ff - p;
+	if ( i + 1 >= len) return len;
+	if ( p[i+1] != 0x00 && (p[i+1] < JPEG_RST0 || p[i+1] > JPEG_RST7)) return i;
+	i += 2;
+    }
+    return len;
+}
+
+/*
+** Find the markers of a JPEG in one pass, walking the segments by their
+** lengths and only searching inside the compressed data. Fills in ix and
+** returns 1 for a whole JPEG, from its SOI through at least one scan to its
+** EOI, or 0 for anything else, such as a frame cut short on the USB bus.
+** Anything after the EOI is ignored, some cameras pad their frames.
+*/
+int jpeg_index_frame( const unsigned char *p, unsigned int len, struct jpeg_index *ix)
+{
+    unsigned int i = 2;
+    unsigned int seglen;
+    unsigned char m;
+
+    memset( ix, 0, sizeof(*ix));
+    if ( len < 4 || p[0] != 0xff || p[1] != JPEG_SOI) return 0;
+
+    for (;;) {
+	if ( i >= len || p[i] != 0xff) return 0;
+	while ( i + 1 < len && p[i+1] == 0xff) i++;    // fill bytes before a marker
+	if ( i + 1 >= len) return 0;
+	m = p[i+1];
+
+	if ( m == JPEG_EOI) {
+	    ix->eoi = i;
+	    return ix->sos != 0;
+	}
+	if ( m == JPEG_TEM || (m >= JPEG_RST0 && m <= JPEG_RST7)) {   // these have no segment
+	    i += 2;
+	    continue;
+	}
+
+	if ( i + 4 > len) return 0;
+	seglen = (p[i+2] << 8) | p[i+3];
+	if ( seglen < 2 || i + 2 + seglen > len) return 0;
+	add_segment( ix, m, i, seglen);
+	if ( m == JPEG_DHT && !ix->dht) ix->dht = i;
+	if ( m == JPEG_SOS && !ix->sos) ix->sos = i;
+
+	i += 2 + seglen;
+	if ( m == JPEG_SOS) i = skip_scan( p, i, len);
+    }
+}
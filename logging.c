@@ -32,6 +32,15 @@ void log_f( const char *format, ...)
   va_end(args);
 }
 
+void warn_f( const char *format, ...)
+{
+  va_list args;
+
+  va_start( args, format);
+  out_f( LOG_WARNING, format, args);
+  va_end(args);
+}
+
 void fatal_f( const char *format, ...)
 {
   va_list args;
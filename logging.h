@@ -2,6 +2,7 @@
 #define LOGGING_IS_IN
 
 void log_f( const char *format, ...);
+void warn_f( const char *format, ...);   // even without --verbose
 void fatal_f( const char *format, ...) __attribute__((noreturn));
 
 #endif
@@ -10,6 +10,7 @@ enum io_method io_method = IO_METHOD_MMAP;
 enum camera_method camera_method = CAMERA_METHOD_MJPEG;
 char *videodev_name = "/dev/video0";
 char *bind_name = "0.0.0.0:8080";
+char *fastcgi_name = 0;
 char *url_prefix = "";
 char *pid_file = 0;
 char *setuid_to = 0;
@@ -24,6 +25,15 @@ int fps = 5;
 int daemon_mode = 0;
 int probe_only = 0;
 int mono = 0;
+int max_connections = 1024;
+int max_streams = 64;
+int listeners = 1;
+int listener_affinity = 0;
+int memfd_frames = 0;
+int workers = 0;
+int socket_mode = 0666;
+int history_seconds = 0;
+int history_megabytes = 16;
 
 static const char short_options [] = "p:d:hmMruvq:s:f:DU:PF:I:i:C:";
 
@@ -49,6 +59,16 @@ long_options [] = {
 	{ "chroot",     required_argument,      NULL,           'C' },
 	{ "password",   required_argument,      NULL,           0 },
 	{ "setup-password", required_argument,  NULL,           0 },
+	{ "max-connections", required_argument, NULL,           0 },
+	{ "max-streams", required_argument,     NULL,           0 },
+	{ "listeners",  required_argument,      NULL,           0 },
+	{ "affinity",   no_argument,            NULL,           0 },
+	{ "memfd",      no_argument,            NULL,           0 },
+	{ "workers",    required_argument,      NULL,           0 },
+	{ "socket-mode", required_argument,     NULL,           0 },
+	{ "fastcgi",    required_argument,      NULL,           0 },
+	{ "history",    required_argument,      NULL,           0 },
+	{ "history-memory", required_argument,  NULL,           0 },
         { 0, 0, 0, 0 }
 };
 
@@ -59,6 +79,7 @@ static void usage(FILE *fp, int argc, char **argv)
 	     "Options:\n"
 	     "-d | --device name       Video device name [/dev/video]\n"
 	     "-p | --port [addr:]port  HTTP daemon port to bind (default: 8080)\n"
+	     "   or --port unix:path   a unix socket instead, unix:@name for an abstract one\n"
 	     "-D | --daemon            Detach and run as a daemon\n"
 	     "-U | --url-prefix        Static prefix to URL, e.g. /camera\n"
 	     "-s | --size widxhgt      Size, e.g. 640x480\n"
@@ -77,6 +98,16 @@ static void usage(FILE *fp, int argc, char **argv)
 	     "-C | --chroot            Chroot to this path after initializing\n"
 	     "--password               Authorization to see images, e.g. user:password\n"
 	     "--setup-password         Authorization to control camera.\n"
+	     "--max-connections num    Open HTTP connections before we answer 503 (default: 1024)\n"
+	     "--max-streams num        Concurrent /image.replace streams (default: 64)\n"
+	     "--listeners num          HTTP listener threads sharing the port (default: 1)\n"
+	     "--affinity               Pin each listener thread to its own CPU\n"
+	     "--memfd                  Serve frames from a memfd with sendfile()\n"
+	     "--workers num            Threads to run request handlers (default: 0, the listeners)\n"
+	     "--socket-mode mode       Permissions for a unix socket (default: 0666)\n"
+	     "--fastcgi [addr:]port    Also answer FastCGI from a web server, or unix:path\n"
+	     "--history seconds        Keep this much of the past for /history (default: 0, none)\n"
+	     "--history-memory MB      Most memory the history may use (default: 16)\n"
 	     "",
 	     argv[0]);
 }
@@ -101,6 +132,26 @@ void do_options(int argc, char **argv)
 		int len = strlen(optarg);
 		setup_password = strdup(optarg);
 		strncpy( optarg, "user:pw", len); // obscure for 'ps' (and we may depend on previous NUL)
+	    } else if ( strcmp( long_options[index].name, "max-connections")==0) {
+		sscanf( optarg,"%d", &max_connections);
+	    } else if ( strcmp( long_options[index].name, "max-streams")==0) {
+		sscanf( optarg,"%d", &max_streams);
+	    } else if ( strcmp( long_options[index].name, "listeners")==0) {
+		sscanf( optarg,"%d", &listeners);
+	    } else if ( strcmp( long_options[index].name, "affinity")==0) {
+		listener_affinity = 1;
+	    } else if ( strcmp( long_options[index].name, "memfd")==0) {
+		memfd_frames = 1;
+	    } else if ( strcmp( long_options[index].name, "workers")==0) {
+		sscanf( optarg,"%d", &workers);
+	    } else if ( strcmp( long_options[index].name, "socket-mode")==0) {
+		sscanf( optarg,"%o", &socket_mode);
+	    } else if ( strcmp( long_options[index].name, "fastcgi")==0) {
+		fastcgi_name = optarg;
+	    } else if ( strcmp( long_options[index].name, "history")==0) {
+		sscanf( optarg,"%d", &history_seconds);
+	    } else if ( strcmp( long_options[index].name, "history-memory")==0) {
+		sscanf( optarg,"%d", &history_megabytes);
 	    }
 	    break;
 	  case 'd':
@@ -2,197 +2,721 @@
  * threaded.c -- A simple multi-threaded HTTPD application.
  */
 
+#define _GNU_SOURCE   // for memfd_create()
+
 #include <pthread.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
 #include <jpeglib.h>
 #include <pwd.h>
+#include <time.h>
+#include <stdint.h>
 
 #include "tinycamd.h"
 #include "httpd.h"
 
-#define MAXFRAME 60
-
-extern char setup_html[];
-extern int setup_html_size;
-extern char tinycamd_js[];
-extern int tinycamd_js_size;
-extern char tinycamd_css[];
-extern int tinycamd_css_size;
+#define BOUNDARY "tinycamdframe"
+
+//
+// The resources, from html.c which util/bintoc writes at build time. Each
+// comes plain, gzipped, and with a hash of its contents.
+//
+extern const char setup_html[], setup_html_gz[], setup_html_hash[];
+extern const int setup_html_size, setup_html_gz_size;
+extern const char tinycamd_js[], tinycamd_js_gz[], tinycamd_js_hash[];
+extern const int tinycamd_js_size, tinycamd_js_gz_size;
+extern const char tinycamd_css[], tinycamd_css_gz[], tinycamd_css_hash[];
+extern const int tinycamd_css_size, tinycamd_css_gz_size;
+
+struct asset {
+    const char *type;
+    const char *data;
+    const int *size;
+    const char *gz;
+    const int *gzSize;     // 0 if gzip didn't help
+    const char *hash;
+};
+#define ASSET(sym,type) { type, sym, &sym##_size, sym##_gz, &sym##_gz_size, sym##_hash }
+
+static const struct asset setupHtml = ASSET( setup_html, "text/html");
+static const struct asset tinycamdJs = ASSET( tinycamd_js, "text/javascript; charset=utf8");
+static const struct asset tinycamdCss = ASSET( tinycamd_css, "text/css");
 
 static void do_status_request( HTTPD_Request req)
 {
-  const char *status = "<html><head><title>Status</title></head>"
-    "<body>status</body>"
-    "</html>";
+  char status[1024];
+  struct httpd_stats st;
+
+  HTTPD_Get_Stats( &st);
+  snprintf( status, sizeof(status),
+	    "<html><head><title>Status</title></head>"
+	    "<body><table>"
+	    "<tr><th>Connections</th><td>%d</td></tr>"
+	    "<tr><th>Streams</th><td>%d</td></tr>"
+	    "<tr><th>Shed connections</th><td>%lu</td></tr>"
+	    "<tr><th>Shed streams</th><td>%lu</td></tr>"
+	    "<tr><th>Dropped frames</th><td>%lu</td></tr>"
+	    "<tr><th>Rejected frames</th><td>%lu</td></tr>"
+	    "</table></body>"
+	    "</html>",
+	    st.connections, st.streams, st.shedConnections, st.shedStreams, st.droppedFrames,
+	    rejected_frames());
 
   HTTPD_Add_Header( req, "Content-type: text/html");
+  HTTPD_Add_Header( req, "Cache-Control: no-cache");
   HTTPD_Send_Body(req, status,strlen(status));
 }
 
-#if 0
-static void put_image(const struct chunk *c, void *arg)
+//
+// Compress a YUYV frame into a JPEG. The caller frees the result.
+//
+static unsigned char *compress_yuyv(const struct chunk *c, unsigned int *size)
 {
-  HTTPD_Request req = (HTTPD_Request)arg;
-  int i,s=0;
-
-  for ( i = 0; c[i].data != 0; i++) s += c[i].length;
-
-    FCGX_FPrintF(req->out, 
-		 "Content-type: image/jpeg\r\n"
-		 "Content-length: %d\r\n"
-		 "\r\n", s);
-    for ( i = 0; c[i].data != 0; i++) {
-	FCGX_PutStr( c[i].data, c[i].length, req->out);
+    unsigned char *jpegBuffer;
+    unsigned int jpegLeft = 1024*1024;
+    unsigned int jpegSize = 0;
+    struct jpeg_compress_struct cinfo = { .dest = 0};
+    struct jpeg_destination_mgr dmgr;
+    struct jpeg_error_mgr err;
+
+    jpegBuffer = malloc(jpegLeft);
+    if ( !jpegBuffer) fatal_f("Failed to allocate JPEG encoding buffer.\n");
+
+    void init_destination(j_compress_ptr cinfo) {
+	struct jpeg_destination_mgr *d = cinfo->dest;
+	d->next_output_byte = jpegBuffer;
+	d->free_in_buffer = jpegLeft;
     }
-    fprintf(stderr,"image size = %d\n",s);
-}
-#endif
-
-static void put_single_image(const struct chunk *c, void *arg)
-{
-  HTTPD_Request req = (HTTPD_Request)arg;
-  int i,s=0;
-
-  HTTPD_Add_Header(req, "Cache-Control: no-cache");
-  HTTPD_Add_Header(req, "Pragma: no-cache");
-  HTTPD_Add_Header(req, "Expires: Thu, 01 Dec 1994 16:00:00 GMT");
-  HTTPD_Add_Header(req, "Content-type: image/jpeg");
-
-  switch(camera_method) {
-    case CAMERA_METHOD_MJPEG:
-    case CAMERA_METHOD_JPEG:
-	{
-	    unsigned char *buffer, *b;
-	    for ( i = 0; c[i].data != 0; i++) s += c[i].length;
-	    buffer = malloc( s);
-	    for ( i = 0, b = buffer; c[i].data != 0; i++) {
-		memcpy( b, c[i].data, c[i].length);
-		b += c[i].length;
-	    }
-	    HTTPD_Send_Body( req, buffer, s);
-	    free(buffer);
-	}
-      break;
-    case CAMERA_METHOD_YUYV:
-	{
-	    unsigned char *jpegBuffer;
-	    unsigned int jpegLeft = 1024*1024;
-	    unsigned int jpegSize = 0;
-	    struct jpeg_compress_struct cinfo = { .dest = 0};
-	    struct jpeg_destination_mgr dmgr;
-	    struct jpeg_error_mgr err;
-
-	    jpegBuffer = malloc(jpegLeft);
-	    if ( !jpegBuffer) fatal_f("Failed to allocate JPEG encoding buffer.\n");
-
-	    void init_destination(j_compress_ptr cinfo) {
-		struct jpeg_destination_mgr *d = cinfo->dest;
-		d->next_output_byte = jpegBuffer;
-		d->free_in_buffer = jpegLeft;
-	    }
-	    int empty_output_buffer(j_compress_ptr cinfo) {
-		//struct jpeg_destination_mgr *d = cinfo->dest;
-		log_f("eob\n");
-		return  TRUE;
-	    }
-	    void term_destination(j_compress_ptr cinfo) {
-		struct jpeg_destination_mgr *d = cinfo->dest;
-		log_f("termdest\n");
-		jpegSize = d->next_output_byte - jpegBuffer;
-	    }
-	    dmgr.init_destination = init_destination;
-	    dmgr.empty_output_buffer = empty_output_buffer;
-	    dmgr.term_destination = term_destination;
-
-	    cinfo.err = jpeg_std_error(&err);
-	    jpeg_create_compress(&cinfo);
-	    cinfo.image_width = video_width;
-	    cinfo.image_height = video_height;
-	    if ( mono) {
-		cinfo.input_components = 1;
-		cinfo.in_color_space = JCS_GRAYSCALE;
-	    } else {
-		cinfo.input_components = 3;
-		cinfo.in_color_space = JCS_YCbCr;
-	    }
-	    jpeg_set_defaults(&cinfo);
-	    jpeg_set_quality(&cinfo, quality, TRUE);
-	    cinfo.dest = &dmgr;
-
-	    jpeg_start_compress( &cinfo, TRUE);
-	    {
-		const unsigned char *b = c[0].data;
-		int row = 0;
-		int col = 0;
-		JSAMPLE pix[video_width*3];
-		JSAMPROW rows[] = { pix};
-		JSAMPARRAY scanlines = rows;
-
-		for ( row = 0; row < video_height; row++) {
-		    JSAMPLE *p = pix;
-		    for ( col = 0; col < video_width; col+=2) {
-			*p++ = b[0];
-			if ( !mono) {
-			    *p++ = b[1];
-			    *p++ = b[3];
-			}
-			*p++ = b[2];
-			if ( !mono) {
-			    *p++ = b[1];
-			    *p++ = b[3];
-			}
-			b += 4;
-		    }
-		    jpeg_write_scanlines( &cinfo, scanlines, 1);
+    int empty_output_buffer(j_compress_ptr cinfo) {
+	//struct jpeg_destination_mgr *d = cinfo->dest;
+	log_f("eob\n");
+	return  TRUE;
+    }
+    void term_destination(j_compress_ptr cinfo) {
+	struct jpeg_destination_mgr *d = cinfo->dest;
+	log_f("termdest\n");
+	jpegSize = d->next_output_byte - jpegBuffer;
+    }
+    dmgr.init_destination = init_destination;
+    dmgr.empty_output_buffer = empty_output_buffer;
+    dmgr.term_destination = term_destination;
+
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    cinfo.image_width = video_width;
+    cinfo.image_height = video_height;
+    if ( mono) {
+	cinfo.input_components = 1;
+	cinfo.in_color_space = JCS_GRAYSCALE;
+    } else {
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+    }
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dest = &dmgr;
+
+    jpeg_start_compress( &cinfo, TRUE);
+    {
+	const unsigned char *b = c[0].data;
+	int row = 0;
+	int col = 0;
+	JSAMPLE pix[video_width*3];
+	JSAMPROW rows[] = { pix};
+	JSAMPARRAY scanlines = rows;
+
+	for ( row = 0; row < video_height; row++) {
+	    JSAMPLE *p = pix;
+	    for ( col = 0; col < video_width; col+=2) {
+		*p++ = b[0];
+		if ( !mono) {
+		    *p++ = b[1];
+		    *p++ = b[3];
+		}
+		*p++ = b[2];
+		if ( !mono) {
+		    *p++ = b[1];
+		    *p++ = b[3];
 		}
+		b += 4;
 	    }
-	    jpeg_finish_compress( &cinfo);
+	    jpeg_write_scanlines( &cinfo, scanlines, 1);
+	}
+    }
+    jpeg_finish_compress( &cinfo);
+    jpeg_destroy_compress( &cinfo);
+
+    *size = jpegSize;
+    return jpegBuffer;
+}
+
+//
+// Everything about the response for a frame except its status line is the
+// same for every client, so it is built once, by the first request after
+// the frame arrives, and shared by the rest. It keeps a reference to the
+// frame's slot and its iovecs point straight at the image there, with the
+// DHT spliced in, so nothing is copied. Whatever a client's socket won't
+// take at once is copied by httpd, so each request lets go of the response
+// as soon as its send returns, and the last one lets go of the slot. The
+// cached one is dropped as soon as a newer frame arrives, so a slot, and
+// perhaps a camera buffer, is never kept by a response nobody wants.
+//
+// With --memfd the part header, the image and the trailing CRLF of a stream
+// part are also written, in that order, into a sealed memfd, and both kinds
+// of request are sent from there with sendfile().
+//
+struct frame_response {
+    int refs;
+    unsigned int serial;
+    char etag[64];
+    struct frame *frame;     // held for as long as we are, 0 for YUYV
+    unsigned char *jpeg;     // our compression of a YUYV frame
+    unsigned int length;
+    struct iovec iov[4];     // the header block and then the image in up to three pieces
+    int count;               // of iov
+    char part[128];          // the multipart header for streams
+    char head[512];
+    int fd;                  // the memfd, or -1
+};
+
+static struct frame_response *cachedResponse = 0;
+static pthread_mutex_t cachedResponseMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_frame_response( struct frame_response *r)
+{
+    if ( __sync_sub_and_fetch( &r->refs, 1)) return;
+    if ( r->fd >= 0) close( r->fd);
+    release_frame( r->frame);
+    free( r->jpeg);
+    free( r);
+}
+
+//
+// Write a frame's stream part into a new memfd and seal it, so it can be
+// handed to sendfile() for as long as anyone needs it. Returns -1 if we
+// can't, and the frame will be sent from memory as usual.
+//
+static int frame_memfd( const struct frame_response *r)
+{
+    struct iovec iov[5];
+    size_t total = 0;
+    int i, n = 0;
+    int fd = memfd_create( "tinycamd-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if ( fd == -1) {
+	log_f("Failed to create frame memfd: %s\n", strerror(errno));
+	return -1;
+    }
+
+    iov[n].iov_base = (void *)r->part;
+    iov[n++].iov_len = strlen(r->part);
+    for ( i = 1; i < r->count; i++) iov[n++] = r->iov[i];
+    iov[n].iov_base = "\r\n";
+    iov[n++].iov_len = 2;
+    for ( i = 0; i < n; i++) total += iov[i].iov_len;
+
+    if ( writev( fd, iov, n) != total ||
+	 fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+	log_f("Failed to fill frame memfd: %s\n", strerror(errno));
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+//
+// Put together the response for a frame, taking over the caller's reference
+// to it. The ETag names the frame by its serial and when it was captured, so
+// that a restart with the serial back at 1 doesn't look like the same frame.
+//
+static struct frame_response *build_frame_response( struct frame *f, const struct chunk *c, const struct frame_info *info)
+{
+    struct frame_response *r = calloc( sizeof(*r), 1);
+    int i;
 
-	    HTTPD_Send_Body( req, jpegBuffer, jpegSize);
-	    free(jpegBuffer);
+    if ( !r) fatal_f("Failed to allocate frame response\n");
+
+    switch(camera_method) {
+      case CAMERA_METHOD_MJPEG:
+      case CAMERA_METHOD_JPEG:
+	r->frame = f;
+	for ( i = 0; c[i].data != 0; i++) {
+	    r->iov[i+1].iov_base = (void *)c[i].data;
+	    r->iov[i+1].iov_len = c[i].length;
+	    r->length += c[i].length;
 	}
-      break;
+	r->count = i+1;
+	break;
+      case CAMERA_METHOD_YUYV:
+      default:
+	r->jpeg = compress_yuyv( c, &r->length);
+	r->iov[1].iov_base = r->jpeg;
+	r->iov[1].iov_len = r->length;
+	r->count = 2;
+	release_frame( f);
+	break;
+    }
+
+    r->refs = 1;
+    r->serial = info->serial;
+    snprintf( r->etag, sizeof(r->etag), "\"%lx.%lx.%x\"",
+	      (unsigned long)info->timestamp.tv_sec, (unsigned long)info->timestamp.tv_usec, info->serial);
+    snprintf( r->head, sizeof(r->head),
+	      "X-Frame-Serial: %u\r\n"
+	      "ETag: %s\r\n"
+	      "Cache-Control: no-cache\r\n"
+	      "Pragma: no-cache\r\n"
+	      "Expires: Thu, 01 Dec 1994 16:00:00 GMT\r\n"
+	      "Content-type: image/jpeg\r\n"
+	      "Content-length: %u\r\n"
+	      "\r\n",
+	      info->serial, r->etag, r->length);
+    r->iov[0].iov_base = r->head;
+    r->iov[0].iov_len = strlen(r->head);
+    snprintf( r->part, sizeof(r->part), "--" BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", r->length);
+
+    r->fd = memfd_frames ? frame_memfd( r) : -1;
+    return r;
+}
+
+//
+// Get a reference to the response for the current frame, building it if we
+// are first.
+//
+static struct frame_response *current_response(void)
+{
+    struct chunk c[4];
+    struct frame_info info;
+    struct frame *f = hold_frame( c, &info);
+    struct frame_response *r;
+
+    pthread_mutex_lock( &cachedResponseMutex);
+    if ( !cachedResponse || cachedResponse->serial != info.serial) {
+	if ( cachedResponse) release_frame_response( cachedResponse);
+	cachedResponse = build_frame_response( f, c, &info);
+	f = 0;
+    }
+    r = cachedResponse;
+    __sync_fetch_and_add( &r->refs, 1);
+    pthread_mutex_unlock( &cachedResponseMutex);
+
+    release_frame( f);   // if it was built already, that one has its own
+    return r;
+}
+
+//
+// From the capture thread, for each new frame. The old response goes, so
+// that its slot can be reused once the sends using it are done. If somebody
+// is building one right now we don't wait, the next request replaces it.
+//
+static void frame_arrived(void)
+{
+    struct frame_response *r = 0;
+
+    if ( pthread_mutex_trylock( &cachedResponseMutex) == 0) {
+	r = cachedResponse;
+	cachedResponse = 0;
+	pthread_mutex_unlock( &cachedResponseMutex);
+    }
+
+    if ( r) release_frame_response( r);
+    HTTPD_Wake_Streams();
+}
+
+static int not_modified(HTTPD_Request req, const struct frame_response *r)
+{
+  char buf[80];
+  const char *match = HTTPD_Get_Header(req, "If-None-Match");
+
+  if ( !match || (!strstr( match, r->etag) && strcmp( match, "*") != 0)) return 0;
+
+  HTTPD_Send_Status(req, 304, "Not Modified");
+  snprintf( buf, sizeof(buf), "X-Frame-Serial: %u", r->serial);
+  HTTPD_Add_Header(req, buf);
+  snprintf( buf, sizeof(buf), "ETag: %s", r->etag);
+  HTTPD_Add_Header(req, buf);
+  HTTPD_Send_No_Body(req);
+  return 1;
+}
+
+static void put_single_image( HTTPD_Request req, struct frame_response *r)
+{
+  if ( !not_modified(req, r)) {
+      if ( r->fd >= 0) HTTPD_Send_File( req, r->iov, 1, r->fd, strlen(r->part), r->length);
+      else HTTPD_Send_Prebuilt( req, r->iov, r->count);
+      log_f("image size = %u\n",r->length);
   }
+}
+
+//
+// One part of a multipart/x-mixed-replace stream, the boundary, its headers and the image.
+//
+static void put_stream_image( HTTPD_Request req, struct frame_response *r)
+{
+    struct iovec iov[5];
+    int i, n = 0;
+
+    if ( r->fd >= 0) {
+	HTTPD_Send_File( req, 0, 0, r->fd, 0, strlen(r->part) + r->length + 2);
+	return;
+    }
 
-  log_f("image size = %d\n",s);
+    iov[n].iov_base = r->part;
+    iov[n++].iov_len = strlen(r->part);
+    for ( i = 1; i < r->count; i++) iov[n++] = r->iov[i];
+    iov[n].iov_base = "\r\n";
+    iov[n++].iov_len = 2;
+
+    HTTPD_Send_Stream_Chunks( req, iov, n);
 }
 
-#if 0
-static void stream_image( HTTPD_Request req)
+//
+// Find a parameter in the query string of a url, 0 if it isn't there.
+//
+static const char *query_param( const char *url, const char *name)
 {
-    int i;
-    const char *boundary = "--myboundary\r\n";
+    const char *p = strchr( url, '?');
+    int len = strlen(name);
 
+    while ( p) {
+	p++;
+	if ( strncmp( p, name, len) == 0 && p[len] == '=') return p+len+1;
+	p = strchr( p, '&');
+    }
+    return 0;
+}
+
+//
+// Find a numeric parameter in the query string of a url, or use the default.
+//
+static unsigned long query_value( const char *url, const char *name, unsigned long def)
+{
+    const char *v = query_param( url, name);
+
+    return v ? strtoul( v, 0, 10) : def;
+}
+
+//
+// A time in the query string, like -20s, -1500ms or -2m, seconds if it has
+// no unit. In ms, or the default if it isn't there.
+//
+static long query_ms( const char *url, const char *name, long def)
+{
+    const char *v = query_param( url, name);
+    char *end;
+    double n;
+
+    if ( !v) return def;
+    n = strtod( v, &end);
+    if ( end == v) return def;
+    if ( strncmp( end, "ms", 2) == 0) return n;
+    if ( *end == 'm') return n * 60000;
+    return n * 1000;
+}
+
+//
+// Long polling for /image.jpg?after=N. Any frame but N is answered at once,
+// otherwise we wait for the next one, or send N again if time runs out.
+//
+static int poll_image( HTTPD_Request req, int expired)
+{
+    unsigned int after = query_value( HTTPD_Get_Url(req), "after", 0);
+    struct frame_response *r = current_response();
+    int sent = 0;
+
+    if ( r->serial != after || expired) {
+	put_single_image( req, r);
+	sent = 1;
+    }
+    release_frame_response(r);
+    return sent;
+}
+
+static void poll_single_image( HTTPD_Request req)
+{
+    unsigned long ms = query_value( HTTPD_Get_Url(req), "timeout", 10000);
+
+    if ( !poll_image( req, ms == 0)) HTTPD_Wait( req, poll_image, ms);
+}
+
+static void stream_frame( HTTPD_Request req)
+{
+    struct frame_response *r = current_response();
+
+    put_stream_image( req, r);
+    release_frame_response(r);
+}
+
+static void stream_image( HTTPD_Request req)
+{
     HTTPD_Add_Header( req, "Cache-Control: no-cache");
     HTTPD_Add_Header( req, "Pragma: no-cache");
     HTTPD_Add_Header( req, "Expires: Thu, 01 Dec 1994 16:00:00 GMT");
-    HTTPD_Add_Header( req, "Content-Type: text/xml");
-    HTTPD_Add_Header( req, "Content-Type: multipart/x-mixed-replace; boundary=--myboundary");
+    HTTPD_Add_Header( req, "Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY);
+    HTTPD_Stream( req, stream_frame);
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//
+// /history?t=-20s for what the camera saw 20 seconds ago, or
+// /history?serial=N for that frame, while we still have it. "Ago" is by
+// when frames arrived from the camera. The data is only pinned while these
+// run, but nothing the socket doesn't take at once is kept past the send.
+//
+static void put_history_image( const struct chunk *c, const struct frame_info *info, void *arg)
+{
+    HTTPD_Request req = arg;
+    char buf[64];
+
+    snprintf( buf, sizeof(buf), "X-Frame-Serial: %u", info->serial);
+    HTTPD_Add_Header( req, buf);
+    HTTPD_Add_Header( req, "Cache-Control: no-cache");
+    HTTPD_Add_Header( req, "Content-type: image/jpeg");
+    HTTPD_Send_Body( req, c[0].data, c[0].length);
+}
+
+static void have_history_image( const struct chunk *c, const struct frame_info *info, void *arg)
+{
+}
+
+//
+// How far back a history request looks, in ms, or -1 after answering it
+// with an error.
+//
+static long history_ago( HTTPD_Request req, const char *url)
+{
+    long t = query_ms( url, "t", 0);
+
+    if ( !history_seconds) {
+	HTTPD_Send_Status( req, 404, "Not Found");
+	HTTPD_Send_Body( req, "404 - No history is kept, see --history", 39);
+	return -1;
+    }
+    if ( t > 0) {
+	HTTPD_Send_Status( req, 400, "Bad Request");
+	HTTPD_Send_Body( req, "400 - The time must be in the past, like t=-20s", 47);
+	return -1;
+    }
+    return -t;
+}
+
+static void history_gone( HTTPD_Request req)
+{
+    HTTPD_Send_Status( req, 404, "Not Found");
+    HTTPD_Send_Body( req, "404 - Not in the history", 24);
+}
+
+static void history_image( HTTPD_Request req, const char *url)
+{
+    long ago = history_ago( req, url);
+
+    if ( ago < 0) return;
+    if ( !with_history_frame( ago, query_value( url, "serial", 0), put_history_image, req)) history_gone( req);
+}
+
+//
+// /history.replace?t=-20s&length=10s plays what the camera saw from 20
+// seconds ago, at the speed it saw it, as a multipart stream. Each new frame
+// from the camera sends the one from that long before, if it is a new one.
+// Without a length it carries on, always that far behind.
+//
+struct clip {
+    unsigned long ago;
+    uint64_t end;          // ms, 0 for never
+    unsigned int last;     // the serial we sent last
+};
+
+static void put_clip_image( const struct chunk *c, const struct frame_info *info, void *arg)
+{
+    HTTPD_Request req = arg;
+    struct clip *clip = HTTPD_Get_Stream_Context( req);
+    char part[128];
+    struct iovec iov[3];
+
+    if ( info->serial == clip->last) return;
+    clip->last = info->serial;
+
+    snprintf( part, sizeof(part), "--" BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", c[0].length);
+    iov[0].iov_base = part;
+    iov[0].iov_len = strlen(part);
+    iov[1].iov_base = (void *)c[0].data;
+    iov[1].iov_len = c[0].length;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    HTTPD_Send_Stream_Chunks( req, iov, 3);
+}
+
+static void clip_frame( HTTPD_Request req)
+{
+    struct clip *clip = HTTPD_Get_Stream_Context( req);
+    struct iovec iov = { .iov_base = "--" BOUNDARY "--\r\n", .iov_len = strlen( "--" BOUNDARY "--\r\n") };
 
-    for(i = 0; i < MAXFRAME; i++) {
-      HTTPD_Send_Body_Chunk( req, boundary, sizeof(boundary)-1);
-      with_next_frame( &put_image, req);
-      HTTPD_Push(req);
+    if ( clip->end && now_ms() >= clip->end) {
+	HTTPD_Send_Stream_Chunks( req, &iov, 1);
+	HTTPD_Stream_End( req);
+	return;
     }
+    with_history_frame( clip->ago, 0, put_clip_image, req);
+}
+
+static void history_clip( HTTPD_Request req, const char *url)
+{
+    long ago = history_ago( req, url);
+    long length = query_ms( url, "length", 0);
+    struct clip *clip;
+
+    if ( ago < 0) return;
+    if ( !with_history_frame( ago, 0, have_history_image, 0)) {
+	history_gone( req);
+	return;
+    }
+
+    clip = calloc( sizeof(*clip), 1);
+    if ( !clip) fatal_f("Failed to allocate clip\n");
+    clip->ago = ago;
+    if ( length > 0) clip->end = now_ms() + length;
+
+    HTTPD_Add_Header( req, "Cache-Control: no-cache");
+    HTTPD_Add_Header( req, "Pragma: no-cache");
+    HTTPD_Add_Header( req, "Expires: Thu, 01 Dec 1994 16:00:00 GMT");
+    HTTPD_Add_Header( req, "Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY);
+    HTTPD_Set_Stream_Context( req, clip);
+    HTTPD_Stream( req, clip_frame);
+}
+
+//
+// Each frame is one binary WebSocket message holding just the JPEG, the
+// very same bytes every other client is sent.
+//
+static void ws_frame( HTTPD_Request req)
+{
+    struct frame_response *r = current_response();
+
+    HTTPD_Send_Message( req, &r->iov[1], r->count-1);
+    release_frame_response(r);
+}
+
+//
+// The client may say "pause", "resume" or "fps N", where 0 is as fast as the camera goes.
+//
+static void ws_control( HTTPD_Request req, const char *data, int length)
+{
+    char msg[64];
+    int rate;
+
+    if ( length >= sizeof(msg)) length = sizeof(msg)-1;
+    memcpy( msg, data, length);
+    msg[length] = 0;
+
+    if ( strcmp( msg, "pause") == 0) HTTPD_Stream_Pause( req, 1);
+    else if ( strcmp( msg, "resume") == 0) HTTPD_Stream_Pause( req, 0);
+    else if ( sscanf( msg, "fps %d", &rate) == 1) HTTPD_Stream_Rate( req, rate);
+    else log_f("Unknown WebSocket message: %s\n", msg);
+}
+
+//
+// A stdio stream whose output becomes the chunked body of req. stdio does
+// the buffering, so however long the answer is it goes out a buffer at a time.
+//
+static ssize_t body_write( void *cookie, const char *data, size_t length)
+{
+    HTTPD_Send_Body_Chunk( (HTTPD_Request)cookie, data, length);
+    return length;
 }
-#endif
 
 static void do_video_call( HTTPD_Request req, video_action action, int cid, int val)
 {
-    char buf[8192];
+    cookie_io_functions_t io = { .write = body_write };
+    FILE *out;
 
-    with_device( action, buf, sizeof(buf), cid, val);
     HTTPD_Add_Header( req, "Cache-Control: no-cache");
     HTTPD_Add_Header( req, "Pragma: no-cache");
     HTTPD_Add_Header( req, "Expires: Thu, 01 Dec 1994 16:00:00 GMT");
     HTTPD_Add_Header( req, "Content-Type: text/xml");
-    HTTPD_Send_Body( req, buf, strlen(buf));
+
+    out = fopencookie( req, "w", io);
+    if ( !out) {
+	log_f("Failed to open body stream: %s\n", strerror(errno));
+	HTTPD_Send_Body( req, "", 0);
+	return;
+    }
+    with_device( action, out, cid, val);
+    fclose( out);
+}
+
+//
+// Does the client take gzip? It must be named, and not with q=0.
+//
+static int accepts_gzip( HTTPD_Request req)
+{
+    const char *h = HTTPD_Get_Header( req, "Accept-Encoding");
+    const char *p;
+
+    for ( p = h; p && (p = strcasestr( p, "gzip")); p += 4) {
+	const char *q = p + 4;
+
+	if ( p > h && p[-1] != ' ' && p[-1] != ',') continue;   // part of some other name
+	while ( *q == ' ') q++;
+	if ( *q == ';') {
+	    while ( *++q == ' ');
+	    return !( (*q == 'q' || *q == 'Q') && q[1] == '=' && strtod( q+2, 0) <= 0);
+	}
+	if ( *q == 0 || *q == ',') return 1;
+    }
+    return 0;
+}
+
+//
+// Send one of the built in resources. The ETag is the content hash, so a
+// browser revalidating gets a 304 unless we have been rebuilt with a new
+// version. The page links to its script and style sheet with ?v=hash, and
+// those URLs can be cached for good, since a new version gets a new URL.
+//
+static void send_asset( HTTPD_Request req, const struct asset *a, const char *url)
+{
+    const char *match = HTTPD_Get_Header( req, "If-None-Match");
+    const char *v = strstr( url, "?v=");
+    int fresh = match && (strstr( match, a->hash) || strcmp( match, "*") == 0);
+    int gz = *a->gzSize && accepts_gzip(req);
+    char buf[128];
+
+    if ( fresh) HTTPD_Send_Status( req, 304, "Not Modified");
+    snprintf( buf, sizeof(buf), "ETag: \"%s%s\"", a->hash, gz ? "-gz" : "");
+    HTTPD_Add_Header( req, buf);
+    HTTPD_Add_Header( req, "Vary: Accept-Encoding");
+    if ( v && strcmp( v+3, a->hash) == 0) {
+	HTTPD_Add_Header( req, "Cache-Control: public, max-age=31536000, immutable");
+    } else {
+	HTTPD_Add_Header( req, "Cache-Control: no-cache");
+    }
+    if ( fresh) {
+	HTTPD_Send_No_Body( req);
+	return;
+    }
+
+    snprintf( buf, sizeof(buf), "Content-type: %s", a->type);
+    HTTPD_Add_Header( req, buf);
+    if ( gz) {
+	HTTPD_Add_Header( req, "Content-Encoding: gzip");
+	HTTPD_Send_Body( req, a->gz, *a->gzSize);
+    } else {
+	HTTPD_Send_Body( req, a->data, *a->size);
+    }
 }
 
 static int demand_authorization(HTTPD_Request req)
@@ -240,20 +764,24 @@ static void handle_requests(HTTPD_Request req, const char *method, const char *r
   if ( strcmp(url,"/status")==0) {
     do_status_request(req);
   } else if ( strcmp(url,"/setup.html")==0) {
-      if ( check_password(req, 1)) {
-	  HTTPD_Add_Header( req, "Content-type: text/html");
-	  HTTPD_Send_Body(req, setup_html,setup_html_size);
-      }
-  } else if ( strcmp(url,"/tinycamd.js")==0) {
-      HTTPD_Add_Header( req, "Content-type: text/javascript; charset=utf8");
-      HTTPD_Send_Body(req, tinycamd_js,tinycamd_js_size);
-  } else if ( strcmp(url,"/tinycamd.css")==0) {
-      HTTPD_Add_Header( req, "Content-type: text/css");
-      HTTPD_Send_Body(req, tinycamd_css,tinycamd_css_size);
-#if 0
-  } else if ( strcmp(url,"/image.replace")==0) {
-    stream_image(req);
-#endif
+      if ( check_password(req, 1)) send_asset( req, &setupHtml, url);
+  } else if ( strcmp(url,"/tinycamd.js")==0 ||
+	      strncmp( url, "/tinycamd.js?", 13) == 0) {
+      send_asset( req, &tinycamdJs, url);
+  } else if ( strcmp(url,"/tinycamd.css")==0 ||
+	      strncmp( url, "/tinycamd.css?", 14) == 0) {
+      send_asset( req, &tinycamdCss, url);
+  } else if ( strcmp(url,"/image.replace")==0 ||
+	      strncmp( url, "/image.replace?", 15) == 0) {
+      if ( check_password(req, 0)) stream_image(req);
+  } else if ( strcmp(url,"/history")==0 ||
+	      strncmp( url, "/history?", 9) == 0) {
+      if ( check_password(req, 0)) history_image( req, url);
+  } else if ( strcmp(url,"/history.replace")==0 ||
+	      strncmp( url, "/history.replace?", 17) == 0) {
+      if ( check_password(req, 0)) history_clip( req, url);
+  } else if ( strcmp(url,"/ws")==0) {
+      if ( check_password(req, 0)) HTTPD_WebSocket( req, ws_frame, ws_control);
   } else if ( strcmp(url,"/controls")==0) {
     do_video_call( req, list_controls,0,0);
   } else if ( sscanf(url,"/set?%d=%d",&cid,&val)==2 ) {
@@ -261,19 +789,20 @@ static void handle_requests(HTTPD_Request req, const char *method, const char *r
   } else if ( strcmp(url,"/")==0 ||
 	      strcmp( url, "/image.jpg") == 0 ||
 	      strncmp( url, "/image.jpg?", 11) == 0) {
-      if ( check_password(req, 0)) with_current_frame( &put_single_image, req);
+      if ( !check_password(req, 0)) return;
+      if ( strstr( url, "?after=") || strstr( url, "&after=")) poll_single_image(req);
+      else {
+	  struct frame_response *r = current_response();
+
+	  put_single_image( req, r);
+	  release_frame_response(r);
+      }
   } else {
     HTTPD_Send_Status( req, 404, "Not Found");
     HTTPD_Send_Body( req, "404 - Not found", 15);
   }
 }
 
-static void *sleeper(void *arg)
-{
-  while(1) sleep(1000);
-  return 0;
-}
-
 int main(int argc, char **argv)
 {
     pthread_t captureThread;
@@ -294,6 +823,11 @@ int main(int argc, char **argv)
 	if ( fclose(pf)==EOF) fatal_f("Failed to close pid file %s: %s\n", pid_file, strerror(errno));
     }
 
+    if ( history_seconds) {
+	if ( camera_method == CAMERA_METHOD_YUYV) fatal_f("--history needs a jpeg or mjpeg camera\n");
+	init_history( history_seconds, history_megabytes);
+    }
+
     open_device();
 
     if ( probe_only) {
@@ -306,19 +840,6 @@ int main(int argc, char **argv)
 
     pthread_create( &captureThread, NULL, main_loop, NULL);
 
-    /*
-    ** I am so sorry. But glibc dynamically loads libgcc_s.so.1 to handle pthread_cancel, so
-    ** I need to get that in before chrooting.
-    */
-    {
-      pthread_t crappyHack;
-      void *whatever;
-
-      if ( pthread_create( &crappyHack, 0, sleeper, 0)) fatal_f("Failed to start test thread.\n");
-      if ( pthread_cancel( crappyHack)) fatal_f("Failed to cancel test thread.\n");
-      if ( pthread_join( crappyHack, &whatever)) fatal_f("Failed to join test thread.\n");
-    }
-
     /*
     ** Slink into our ghetto and lower our privileges in preparation for handling queries.
     */
@@ -341,7 +862,13 @@ int main(int argc, char **argv)
         }
     }
 
+    HTTPD_Set_Limits( max_connections, max_streams);
+    HTTPD_Set_Listeners( listeners, listener_affinity);
+    HTTPD_Set_Workers( workers);
+    HTTPD_Set_Socket_Mode( socket_mode);
     httpdThread = HTTPD_Start( bind_name, handle_requests);
+    if ( fastcgi_name) HTTPD_Start_FastCGI( fastcgi_name, handle_requests);
+    set_frame_listener( frame_arrived);
 
     for(;;) sleep(100);
 
@@ -1,6 +1,9 @@
 #ifndef TINYCAMD_IS_IN
 #define TINYCAMD_IS_IN
 
+#include <stdio.h>
+#include <sys/time.h>
+
 enum io_method {
         IO_METHOD_READ,
         IO_METHOD_MMAP,
@@ -17,6 +20,7 @@ extern enum io_method io_method;
 extern enum camera_method camera_method;
 extern char *videodev_name;
 extern char *bind_name;
+extern char *fastcgi_name;
 extern char *url_prefix;
 extern char *pid_file;
 extern char *setuid_to;
@@ -37,13 +41,42 @@ extern int quality;
 extern int mono;
 extern int fps;
 extern int probe_only;
+extern int max_connections;
+extern int max_streams;
+extern int listeners;
+extern int listener_affinity;
+extern int memfd_frames;
+extern int workers;
+extern int socket_mode;
+extern int history_seconds;
+extern int history_megabytes;
 
 struct chunk {
     const void *data;
     unsigned int length;
 };
-typedef void (*frame_sender) (const struct chunk *, void *);
-typedef int (*video_action)( int fd, char *buf, int used, int cid, int val);
+#define JPEG_SEGMENTS 16
+struct jpeg_segment {
+    unsigned int offset;         // of the 0xff of its marker
+    unsigned short length;       // from its length field, which counts itself but not the marker
+    unsigned char marker;        // 0xdb DQT, 0xc4 DHT, 0xda SOS, 0xe0 to 0xef APPn, ...
+};
+struct jpeg_index {              // offsets are in the frame as the camera gave it
+    unsigned int sos;            // the first SOS, where a missing DHT goes
+    unsigned int eoi;
+    unsigned int dht;            // the first DHT, 0 if there isn't one
+    unsigned int count;          // segments found, only the first JPEG_SEGMENTS are kept
+    struct jpeg_segment segments[JPEG_SEGMENTS];
+};
+int jpeg_index_frame( const unsigned char *p, unsigned int len, struct jpeg_index *ix);   // 1 if it's a whole JPEG
+
+struct frame_info {
+    unsigned int serial;         // counts up from 1 with each frame
+    struct timeval timestamp;    // when it was captured
+    const struct jpeg_index *jpeg;   // where its markers are, 0 for YUYV frames
+};
+typedef void (*frame_sender) (const struct chunk *, const struct frame_info *, void *);
+typedef int (*video_action)( int fd, FILE *out, int cid, int val);
 
 void open_device();
 void init_device();
@@ -52,18 +85,29 @@ void start_capturing();
 void *main_loop(void *args);
 void stop_capturing();
 void close_device();
-int with_device( video_action func, char *buf, int size, int cid, int val);
+int with_device( video_action func, FILE *out, int cid, int val);
 
 void do_probe();
 
 #ifdef __LINUX_VIDEODEV2_H
 void new_frame( void *data, unsigned int length, struct v4l2_buffer *buf);
+int reclaim_buffer( struct v4l2_buffer *buf);   // one for the capture thread to queue again, 0 if none
 #endif
+void set_frame_buffers( unsigned int count);
+struct frame;
+struct frame *hold_frame( struct chunk c[4], struct frame_info *info);   // 0, and no chunks, before the first frame
+void release_frame( struct frame *f);
 void with_current_frame( frame_sender func, void *arg);
 void with_next_frame( frame_sender func, void *arg);
+void set_frame_listener( void (*func)(void));
+unsigned long rejected_frames(void);   // thrown away as not whole JPEGs
+
+void init_history( unsigned int seconds, unsigned int megabytes);
+void history_add( const struct chunk *c, const struct frame_info *info);
+int with_history_frame( unsigned long ago, unsigned int serial, frame_sender func, void *arg);   // 0 if it's gone
 
-int list_controls( int fd, char *buf, int used, int cid, int val);
-int set_control( int fd, char *buf, int used, int cid, int val);
+int list_controls( int fd, FILE *out, int cid, int val);
+int set_control( int fd, FILE *out, int cid, int val);
 void add_logitech_controls(int fd);
 
 #include "logging.h"
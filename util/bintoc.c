@@ -5,9 +5,220 @@
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <zlib.h>
 
 #define MAXSYM 256
 
+//
+// Each symbol we have emitted so far, so a later file can refer to the
+// content hash of an earlier one as @symbol@.
+//
+static struct {
+    char sym[1024];
+    char hash[17];
+} done[MAXSYM];
+static int nDone = 0;
+
+static unsigned char *read_file( const char *fname, size_t *length)
+{
+    FILE *f;
+    unsigned char *data = 0;
+    size_t size = 0;
+
+    f = fopen( fname, "r");
+    if ( !f) {
+	fprintf(stderr,"Failed to open `%s' for reading: %s\n", fname, strerror(errno));
+	exit(1);
+    }
+
+    *length = 0;
+    for (;;) {
+	size_t c;
+
+	if ( *length == size) {
+	    size = size ? size*2 : 65536;
+	    data = realloc( data, size);
+	    if ( !data) {
+		fprintf(stderr,"Out of memory reading %s\n", fname);
+		exit(1);
+	    }
+	}
+	c = fread( data + *length, 1, size - *length, f);
+	if ( c == 0) {
+	    if ( ferror(f)) {
+		fprintf(stderr,"Error reading %s: %s\n", fname, strerror(errno));
+		exit(1);
+	    }
+	    break;
+	}
+	*length += c;
+    }
+    fclose(f);
+    return data;
+}
+
+//
+// Replace each @symbol@ naming an earlier file with that file's hash, so a
+// page can link to "tinycamd.js?v=@tinycamd_js@" and have the URL change
+// whenever the script does. Anything else between @s is left alone.
+//
+static unsigned char *substitute( unsigned char *data, size_t *length)
+{
+    unsigned char *out = malloc( *length + 1);
+    size_t i, used = 0;
+
+    if ( !out) {
+	fprintf(stderr,"Out of memory substituting\n");
+	exit(1);
+    }
+
+    for ( i = 0; i < *length; i++) {
+	size_t j = i + 1;
+	int k;
+
+	if ( data[i] != '@') {
+	    out[used++] = data[i];
+	    continue;
+	}
+	while( j < *length && (isalnum(data[j]) || data[j] == '_')) j++;
+	for ( k = 0; j < *length && data[j] == '@' && k < nDone; k++) {
+	    if ( strlen(done[k].sym) == j-i-1 && memcmp( done[k].sym, data+i+1, j-i-1) == 0) break;
+	}
+	if ( j >= *length || data[j] != '@' || k >= nDone) {
+	    out[used++] = data[i];
+	    continue;
+	}
+	// room for the hash and all the input after the closing @
+	out = realloc( out, used + 16 + (*length - j));
+	if ( !out) {
+	    fprintf(stderr,"Out of memory substituting\n");
+	    exit(1);
+	}
+	memcpy( out + used, done[k].hash, 16);
+	used += 16;
+	i = j;
+    }
+    free(data);
+    *length = used;
+    return out;
+}
+
+//
+// FNV-1a, 64 bits, which is plenty to tell versions of a few files apart.
+//
+static void hash_data( const unsigned char *data, size_t length, char hash[17])
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for ( i = 0; i < length; i++) {
+	h ^= data[i];
+	h *= 0x100000001b3ULL;
+    }
+    snprintf( hash, 17, "%016llx", h);
+}
+
+//
+// Gzip it as hard as we can. The header carries no name or time, so the
+// output only changes when the input does.
+//
+static unsigned char *gzip_data( const unsigned char *data, size_t length, size_t *gzLength)
+{
+    z_stream z;
+    unsigned char *out;
+    size_t size;
+
+    memset( &z, 0, sizeof(z));
+    if ( deflateInit2( &z, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+	fprintf(stderr,"Failed to start compressing: %s\n", z.msg ? z.msg : "unknown error");
+	exit(1);
+    }
+    size = deflateBound( &z, length);
+    out = malloc( size);
+    if ( !out) {
+	fprintf(stderr,"Out of memory compressing\n");
+	exit(1);
+    }
+    z.next_in = (unsigned char *)data;
+    z.avail_in = length;
+    z.next_out = out;
+    z.avail_out = size;
+    if ( deflate( &z, Z_FINISH) != Z_STREAM_END) {
+	fprintf(stderr,"Failed to compress: %s\n", z.msg ? z.msg : "unknown error");
+	exit(1);
+    }
+    *gzLength = z.total_out;
+    deflateEnd( &z);
+    return out;
+}
+
+static void emit_string( FILE *out, const char *sym, const char *suffix, const unsigned char *data, size_t length)
+{
+    size_t i;
+    int pos;
+    int j;
+    int indent;
+
+    fprintf( out, "const char %s%s[] = \"", sym, suffix);
+    indent = 15 + strlen(sym) + strlen(suffix);
+
+    pos = 0;
+    for ( i = 0; i < length; i++) {
+	int ch = data[i];
+
+	switch(ch) {
+	  case '\n':
+	    fprintf(out,"\\n");
+	    pos += 2;
+	    break;
+	  case '\r':
+	    fprintf(out,"\\r");
+	    pos += 2;
+	    break;
+	  case '\t':
+	    fprintf(out,"\\t");
+	    pos += 2;
+	    break;
+	  case '\\':
+	    fprintf(out,"\\\\");
+	    pos += 2;
+	    break;
+	  case '"':
+	    fprintf(out,"\\\"");
+	    pos += 2;
+	    break;
+	  case '?':
+	    fprintf(out,"\\?");   // so "??" can't make a trigraph
+	    pos += 2;
+	    break;
+	  default:
+	    if ( isgraph(ch) || ch == ' ') {
+		fputc(ch,out);
+		pos += 1;
+	    } else {
+		fprintf(out, "\\%03o", ch);
+		pos += 4;
+	    }
+	}
+	if ( pos >= 64) {
+	    fputc('"', out);
+	    fputc('\n', out);
+	    for ( j = 0; j < indent; j++) fputc(' ', out);
+	    fputc('"', out);
+	    pos = 0;
+	}
+    }
+    fputc('"', out);
+    fputc(';', out);
+    fputc('\n', out);
+    fprintf( out, "const int %s%s_size = sizeof(%s%s)-1;\n", sym, suffix, sym, suffix);
+}
+
+//
+// For each sym=file emit sym[] and sym_size with the contents, sym_gz[] and
+// sym_gz_size with it gzipped (empty if that doesn't make it smaller), and
+// sym_hash[], a hex hash of the contents for ETags and versioned URLs.
+//
 int main( int argc, char **argv)
 {
     int i;
@@ -21,78 +232,34 @@ int main( int argc, char **argv)
     for ( i = 1; i < argc; i++) {
 	char sym[1024];
 	char fname[1024];
-	FILE *f;
-	int pos;
-	int j;
-	int indent;
+	char hash[17];
+	unsigned char *data, *gz;
+	size_t length, gzLength;
 
 	if ( sscanf( argv[i], "%1023[^=]=%1023s", sym, fname) != 2) {
 	    fprintf(stderr,"Argument '%s' is too mysterious to process.\n", argv[i]);
 	    exit(1);
 	}
-
-	f = fopen( fname, "r");
-	if ( !f) {
-	    fprintf(stderr,"Failed to open `%s' for reading: %s\n", fname, strerror(errno));
+	if ( nDone >= MAXSYM) {
+	    fprintf(stderr,"Too many files, at most %d.\n", MAXSYM);
 	    exit(1);
 	}
 
-	fprintf( out, "const char %s[] = \"", sym);
-	indent = 15 + strlen(sym);
-
-	pos = 0;
-	for (;;) {
-	    int ch = fgetc(f);
-	    if ( ch == EOF) {
-		if ( ferror(f)) {
-		    fprintf(stderr,"Error reading %s: %s\n", fname, strerror(errno));
-		    exit(1);
-		}
-		break;
-	    }
-	    switch(ch) {
-	      case '\n':
-		fprintf(out,"\\n");
-		pos += 2;
-		break;
-	      case '\r':
-		fprintf(out,"\\r");
-		pos += 2;
-		break;
-	      case '\t':
-		fprintf(out,"\\t");
-		pos += 2;
-		break;
-	      case '\\':
-		fprintf(out,"\\\\");
-		pos += 2;
-		break;
-	      case '"':
-		fprintf(out,"\\\"");
-		pos += 2;
-		break;
-	      default:
-		if ( isgraph(ch) || ch == ' ') {
-		    fputc(ch,out);
-		    pos += 1;
-		} else {
-		    fprintf(out, "\\%03o", ch);
-		    pos += 3;
-		}
-	    }
-	    if ( pos >= 64) {
-		fputc('"', out);
-		fputc('\n', out);
-		for ( j = 0; j < indent; j++) fputc(' ', out);
-		fputc('"', out);
-		pos = 0;
-	    }
-	}
-	fputc('"', out);
-	fputc(';', out);
-	fputc('\n', out);
-	fprintf( out, "const int %s_size = sizeof(%s)-1;\n", sym, sym);
+	data = substitute( read_file( fname, &length), &length);
+	hash_data( data, length, hash);
+	gz = gzip_data( data, length, &gzLength);
+	if ( gzLength >= length) gzLength = 0;
+
+	emit_string( out, sym, "", data, length);
+	emit_string( out, sym, "_gz", gz, gzLength);
+	fprintf( out, "const char %s_hash[] = \"%s\";\n", sym, hash);
 	fputc('\n', out);
+
+	strcpy( done[nDone].sym, sym);
+	strcpy( done[nDone].hash, hash);
+	nDone++;
+	free(data);
+	free(gz);
     }
 
     if ( ferror( out)) {